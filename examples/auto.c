@@ -72,7 +72,7 @@ t_scope_cleanup(const void **frame)
 	}
 }
 
-#define t_new(_type) (_type *)psca_malloc(g_pool_s.psca_pool, sizeof(_type))
+#define t_new(_type) (_type *)PSCA_MALLOC(g_pool_s.psca_pool, sizeof(_type))
 #define t_scope__(n) const void *psca_scope_##n __attribute__((unused,cleanup(t_scope_cleanup))) = psca_push(g_pool_s.psca_pool);
 #define t_scope_(n) t_scope__(n)
 #define t_scope t_scope_(__LINE__)
@@ -135,6 +135,12 @@ main(int          argc,
 	fprintf(stdout, "# of deallocations: %lu\n", g_pool_s.num_deallocations);
 	fprintf(stdout, "overhead: %lu bytes\n", g_pool_s.alloc_size - (LIST_SIZE * sizeof(struct list) * NUM_LOOPS));
 
+#ifdef PSCA_TRACK_SITES
+	fprintf(stdout, "\nallocation sites:\n");
+	fflush(stdout);
+	psca_write_sites(STDOUT_FILENO);
+#endif
+
 	return 0;
 }
 
@@ -17,14 +17,127 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "psca.h"
 
 #define PSCA_POOL_DEFAULT_BLOCK_SIZE    (64 * 1024)
 #define PSCA_POOL_DEFAULT_GROWTH_FACTOR (2)
+#define PSCA_POOL_DEFAULT_BLOCK_GROWTH  (1)
+#define PSCA_POOL_DEFAULT_MAX_BLOCK     (64 * 1024 * 1024)
+#define PSCA_POOL_DEFAULT_REDZONE       (16)
+#define PSCA_POOL_PROFILES              (64)
+#define PSCA_POOL_MIN_ADAPTIVE_SIZE     (4 * 1024)
+#define PSCA_POOL_FRAME_CHUNK           (64)
+#define PSCA_POOL_MAX_SPARES            (4)
+#define PSCA_RECLAIMER_DEFAULT_LIMIT    (256)
+#define PSCA_PROF_MAX_DEPTH             (32)
+#define PSCA_PROF_MIN_STACKS            (64)
+#define PSCA_TRACE_BUFFER               (64 * 1024)
+#define PSCA_EXPORT_MAGIC               UINT64_C(0x7073636173746174) /* "pscastat" */
+#define PSCA_EXPORT_RETRIES             (1000)
+
+/*
+ * Memory poisoning. Blocks are large allocations from the provider, so
+ * without help from the pool, memory checkers consider everything in them
+ * addressable. When built with poisoning, free space in a frame and
+ * released frames are poisoned for AddressSanitizer and memcheck, every
+ * allocation is followed by a redzone, and each frame is registered with
+ * memcheck as a mempool holding its allocations.
+ */
+#if defined(PSCA_WITH_VALGRIND) && !defined(PSCA_WITH_POISONING)
+#define PSCA_WITH_POISONING
+#endif
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) && !defined(__SANITIZE_ADDRESS__)
+#define __SANITIZE_ADDRESS__
+#endif
+#endif
+
+#if defined(PSCA_WITH_POISONING) && defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define PSCA_ASAN_POISON(_a, _s)   ASAN_POISON_MEMORY_REGION((_a), (_s))
+#define PSCA_ASAN_UNPOISON(_a, _s) ASAN_UNPOISON_MEMORY_REGION((_a), (_s))
+#else
+#define PSCA_ASAN_POISON(_a, _s)   ((void)0)
+#define PSCA_ASAN_UNPOISON(_a, _s) ((void)0)
+#endif
+
+#if defined(PSCA_WITH_VALGRIND)
+#include <valgrind/memcheck.h>
+#define PSCA_VG_NOACCESS(_a, _s)   VALGRIND_MAKE_MEM_NOACCESS((_a), (_s))
+#define PSCA_VG_UNDEFINED(_a, _s)  VALGRIND_MAKE_MEM_UNDEFINED((_a), (_s))
+#define PSCA_VG_POOL_NEW(_f)       VALGRIND_CREATE_MEMPOOL((_f), 0, 0)
+#define PSCA_VG_POOL_DEL(_f)       VALGRIND_DESTROY_MEMPOOL((_f))
+#define PSCA_VG_POOL_ALLOC(_f, _a, _s) \
+	VALGRIND_MEMPOOL_ALLOC((_f), (_a), (_s))
+#define PSCA_VG_POOL_RESIZE(_f, _a, _s) \
+	VALGRIND_MEMPOOL_CHANGE((_f), (_a), (_a), (_s))
+#define PSCA_VG_POOL_FREE(_f, _a)  VALGRIND_MEMPOOL_FREE((_f), (_a))
+#define PSCA_VG_POOL_MOVE(_f, _to) VALGRIND_MOVE_MEMPOOL((_f), (_to))
+#define PSCA_VG_DEFINED(_a, _s)    VALGRIND_MAKE_MEM_DEFINED((_a), (_s))
+#else
+#define PSCA_VG_NOACCESS(_a, _s)   ((void)0)
+#define PSCA_VG_UNDEFINED(_a, _s)  ((void)0)
+#define PSCA_VG_POOL_NEW(_f)       ((void)0)
+#define PSCA_VG_POOL_DEL(_f)       ((void)0)
+#define PSCA_VG_POOL_ALLOC(_f, _a, _s) ((void)0)
+#define PSCA_VG_POOL_RESIZE(_f, _a, _s) ((void)0)
+#define PSCA_VG_POOL_FREE(_f, _a)  ((void)0)
+#define PSCA_VG_POOL_MOVE(_f, _to) ((void)0)
+#define PSCA_VG_DEFINED(_a, _s)    ((void)0)
+#endif
+
+#define PSCA_POISON(_a, _s) do { \
+	PSCA_ASAN_POISON((_a), (_s)); \
+	PSCA_VG_NOACCESS((_a), (_s)); \
+} while (0)
+
+#define PSCA_UNPOISON(_a, _s) do { \
+	PSCA_ASAN_UNPOISON((_a), (_s)); \
+	PSCA_VG_UNDEFINED((_a), (_s)); \
+} while (0)
+
+/*
+ * USDT probes, for tracing the pool with bpftrace, SystemTap or perf. Each
+ * probe site is a single nop until a tracer attaches to it:
+ *
+ *   push(pool, frame, depth)
+ *   pop(pool, frame, used, depth)
+ *   grow(pool, frame, size, depth)          malloc slow path
+ *   block_acquire(pool, block, size, depth) block from the provider
+ *   block_release(pool, block, size)        block back to the provider
+ */
+#ifdef PSCA_WITH_SDT
+#include <sys/sdt.h>
+#define PSCA_PROBE3(_n, _a, _b, _c) DTRACE_PROBE3(psca, _n, _a, _b, _c)
+#define PSCA_PROBE4(_n, _a, _b, _c, _d) \
+	DTRACE_PROBE4(psca, _n, _a, _b, _c, _d)
+#else
+#define PSCA_PROBE3(_n, _a, _b, _c) ((void)0)
+#define PSCA_PROBE4(_n, _a, _b, _c, _d) ((void)0)
+#endif
+
+#ifdef PSCA_WITH_POISONING
+#define PSCA_REDZONE(_pool) ((_pool)->redzone)
+#else
+#define PSCA_REDZONE(_pool) ((size_t)0)
+#endif
 
 /*
  * A block in the system is an allocated chunk of memory. It can be used
@@ -33,14 +146,41 @@
  * a block is allocated such that multiple frames may exist in a block,
  * so that deallocations are nothing more than moving a pointer to a
  * previous spot in a block.
+ *
+ * A frame keeps its own blocks and its side blocks (see psca_malloc_in())
+ * in separate lists. `seq` numbers blocks in the order frames took them, so
+ * the two lists can be put back in that order when the frame goes away,
+ * which stack-like providers rely on. `pad` keeps the usable part of a
+ * block as aligned as the block itself.
  */
 struct psca_block {
 	struct psca_block *prev;
 	size_t             size;
+	size_t             seq;
+	size_t             pad;
 };
 
 typedef struct psca_block psca_block_t;
 
+/*
+ * A chain is a list of blocks on their way out, from newest to oldest,
+ * along with its oldest block. Knowing both ends, the blocks of any number
+ * of frames can be gathered into one chain and released (or set aside) in
+ * one go. `top` and `bottom` are the depths of the frames that owned its
+ * newest and oldest blocks, `count` and `bytes` what it holds, headers
+ * included.
+ */
+struct psca_chain {
+	struct psca_block *head;
+	struct psca_block *tail;
+	unsigned           top;
+	unsigned           bottom;
+	size_t             count;
+	size_t             bytes;
+};
+
+typedef struct psca_chain psca_chain_t;
+
 /*
  * A frame is a state in the allocation stack that points to a location
  * in a block. A frame can own blocks, and when the frame is removed from
@@ -49,236 +189,2690 @@ typedef struct psca_block psca_block_t;
  * All psca_malloc calls are actually just moving a pointer in the top-most
  * frame.
  *
- * Instead of allocating a frame using malloc, the frame structure is stored
- * inside of a block. This is to prevent any non-managed memory allocations
- * from occurring. This does mean that there is some overhead due to
- * allocations, but the positives outweigh the negatives.
+ * Frames are not stored in the blocks themselves, but in a separate stack
+ * of frame records kept by the pool (see struct psca_frame_chunk). Pushing
+ * and popping a frame therefore never costs room in a block, and never
+ * needs a new block just to hold the frame.
+ *
+ * A frame that is not at the top of the stack can still be allocated from
+ * with psca_malloc_in(). Those allocations come from separate "side"
+ * blocks, since the frame's own blocks are in use by the frames above it.
  */
 struct psca_frame {
-	struct psca_block *blocks;
-	struct psca_frame *prev;
-	uint8_t           *next;
-	size_t             free;
+	struct psca_block   *blocks;
+	struct psca_block   *first;
+	struct psca_frame   *prev;
+	uint8_t             *next;
+	size_t               free;
+	struct psca_block   *side;
+	uint8_t             *side_next;
+	size_t               side_free;
+	size_t               used;
+	size_t               first_size;
+	size_t               block_count;
+	size_t               block_bytes;
+	unsigned             depth;
+	struct psca_profile *profile;
+	struct psca_flame_node *flame;
+	size_t               peak;
 };
 
 typedef struct psca_frame psca_frame_t;
 
 /*
- * A pool is nothing more than a stack of frames (implemented as a linked
- * list) that stores some information about how memory should be allocated.
- * It is exposed to the user as an opaque pointer.
+ * Frame records are kept in chunks of contiguous records, linked together
+ * as the stack gets deeper. Chunks are never moved, so a frame's address
+ * is a stable handle for as long as it is on the stack, and they are kept
+ * around once allocated, so a pool that has reached its deepest point
+ * pushes and pops frames without allocating anything. Being kept around is
+ * also why they come from malloc() rather than from the block provider.
+ */
+struct psca_frame_chunk {
+	struct psca_frame_chunk *prev;
+	struct psca_frame_chunk *next;
+	psca_frame_t             frames[PSCA_POOL_FRAME_CHUNK];
+};
+
+typedef struct psca_frame_chunk psca_frame_chunk_t;
+
+/*
+ * A profile remembers how much memory frames pushed with the same label,
+ * or at the same depth when they have no label, ended up using. It is used
+ * to size the first block of the next such frame. Profiles live in a small
+ * direct-mapped table, so a profile may be taken over by another one that
+ * hashes to the same slot, which only costs a poorer guess.
+ */
+struct psca_profile {
+	const char *label;
+	unsigned    depth;
+	size_t      expected;
+};
+
+typedef struct psca_profile psca_profile_t;
+
+/*
+ * A job handed to a reclaimer, written at the start of the newest block
+ * of the chain it releases. It carries the functions of the pool the
+ * blocks came from, so the pool can go away before the job is run.
+ *
+ * A job with a pool asks for the pool's spare blocks to be refilled
+ * instead. A pool has at most one such job queued, and waits for it to
+ * be done before going away.
+ */
+struct psca_reclaim_job {
+	struct psca_reclaim_job *next;
+	psca_free_func_t         free_func;
+	psca_free_batch_func_t   free_batch_func;
+	void                    *context;
+	struct psca_pool        *pool;
+};
+
+typedef struct psca_reclaim_job psca_reclaim_job_t;
+
+/*
+ * A call stack seen by the sampling profiler, with the samples taken from
+ * it. The pool keeps them in a chained hash table keyed on the program
+ * counters.
+ */
+struct psca_prof_stack {
+	struct psca_prof_stack *next;
+	size_t  hash;
+	size_t  allocs;
+	size_t  bytes;
+	size_t  inuse_allocs;
+	size_t  inuse_bytes;
+	int     depth;
+	void   *pcs[PSCA_PROF_MAX_DEPTH];
+};
+
+typedef struct psca_prof_stack psca_prof_stack_t;
+
+/*
+ * A sample whose allocation is still alive. Samples are only taken in the
+ * top-most frame, so these are ordered by frame depth, and popping a frame
+ * retires them from the end.
+ */
+struct psca_prof_live {
+	psca_prof_stack_t *stack;
+	size_t             bytes;
+	unsigned           depth;
+};
+
+typedef struct psca_prof_live psca_prof_live_t;
+
+/*
+ * A node in the tree of label paths, used for flamegraph exports. Every
+ * labeled frame is accounted to the node of its label under its parent's
+ * node, unlabeled frames to their parent's node.
+ */
+struct psca_flame_node {
+	const char             *label;
+	struct psca_flame_node *parent;
+	struct psca_flame_node *child;
+	struct psca_flame_node *sibling;
+	size_t                  total;
+	size_t                  peak;
+};
+
+typedef struct psca_flame_node psca_flame_node_t;
+
+/*
+ * Trace records are gathered in a buffer and written out when it fills
+ * up, so tracing costs a write() every few thousand operations.
+ */
+struct psca_trace {
+	int     fd;
+	size_t  len;
+	uint8_t buf[PSCA_TRACE_BUFFER];
+};
+
+typedef struct psca_trace psca_trace_t;
+
+/*
+ * The page a pool publishes its counters in. The pool is the only writer,
+ * and bumps the sequence number before and after changing the counters,
+ * so a reader that sees the same even number on both sides of its copy
+ * knows the copy is consistent.
+ */
+struct psca_export_page {
+	uint64_t      magic;
+	unsigned      seq;
+	unsigned      pad;
+	psca_export_t info;
+};
+
+typedef struct psca_export_page psca_export_page_t;
+
+/*
+ * A pool is nothing more than a stack of frames (implemented as chunks of
+ * frame records) that stores some information about how memory should be
+ * allocated. It is exposed to the user as an opaque pointer.
  */
 struct psca_pool {
 	struct psca_frame *frames;
+	psca_frame_chunk_t *chunk;
 	psca_alloc_func_t  alloc_func;
+	psca_alloc_hint_func_t alloc_hint_func;
 	psca_free_func_t   free_func;
+	psca_free_batch_func_t free_batch_func;
+	psca_block_info_t *batch;
+	size_t             batch_cap;
 	size_t             block_size;
 	int                growth_factor;
+	int                block_growth;
+	size_t             max_block_size;
+	size_t             redzone;
+	size_t             write_size;
+	size_t             adaptive_limit;
+	size_t             block_seq;
+	int                defer_free;
+	size_t             release_limit;
+	psca_block_t      *pending;
+	psca_block_t      *pending_tail;
+	unsigned           pending_depth;
+	struct psca_reclaimer *reclaimer;
+	struct psca_block *spares[PSCA_POOL_MAX_SPARES];
+	int                spare_count;
+	int                spare_queued;
+	psca_reclaim_job_t spare_job;
+	psca_stats_t       stats;
+	int                timing;
+	psca_histogram_t   histograms[PSCA_HIST_COUNT];
+	size_t             sample_interval;
+	size_t             sample_left;
+	uint64_t           sample_rng;
+	psca_prof_stack_t **prof_stacks;
+	size_t             prof_len;
+	size_t             prof_cap;
+	psca_prof_live_t  *prof_live;
+	size_t             prof_live_len;
+	size_t             prof_live_cap;
+	int                flame_enabled;
+	psca_flame_node_t  flame_root;
+	psca_trace_t      *trace;
+	char               name[PSCA_NAME_MAX];
+	psca_export_page_t *export;
 	void              *context;
+	psca_profile_t     profiles[PSCA_POOL_PROFILES];
+#ifdef PSCA_WITH_VALGRIND
+	struct psca_vg_merged *vg_merged;
+	size_t             vg_merged_len;
+	size_t             vg_merged_cap;
+#endif
 };
 
 typedef struct psca_pool psca_pool_t;
 
-/* adds a block to a chain */
-static inline psca_block_t *
-psca_block_add(psca_pool_t   *pool, /* in: the pool that owns the block */
-               psca_block_t  *prev, /* in: previous block in the frame */
-               size_t         size)
+/*
+ * A reclaimer releases chains of blocks on a thread of its own. Pools push
+ * jobs on a lock-free stack, and the thread takes the whole stack at once,
+ * so jobs are never removed one by one and the stack is safe from ABA.
+ * The thread releases blocks through a pool of its own, whose functions
+ * are set from each job in turn. This is exposed to the user as an opaque
+ * pointer.
+ */
+struct psca_reclaimer {
+	psca_reclaim_job_t *jobs;
+	size_t              pending;
+	size_t              limit;
+	int                 stop;
+	sem_t               wake;
+	pthread_t           thread;
+	psca_pool_t         pool;
+};
+
+typedef struct psca_reclaimer psca_reclaimer_thr_t;
+
+#define PSCA_RECLAIMER_P(_p) ((psca_reclaimer_thr_t *)(_p))
+
+#ifdef PSCA_WITH_VALGRIND
+/*
+ * When a frame is merged into its parent, its memcheck mempool has to live
+ * on until the parent is popped. The mempool is moved to an address that
+ * stays unique for that long (a byte allocated in the frame) and recorded
+ * here along with the depth of the frame that now owns it. Since frames
+ * are popped in stack order, so are these records.
+ */
+struct psca_vg_merged {
+	const void *anchor;
+	unsigned    depth;
+};
+
+/* records the mempool of a frame being merged into its parent */
+static void
+psca_vg_merge(psca_pool_t *pool,   /* in: the pool */
+              const void  *frame,  /* in: the frame being merged */
+              const void  *anchor, /* in: where to move its mempool */
+              unsigned     depth)  /* in: depth of the frame */
 {
-	psca_block_t *block;
-	size += sizeof(psca_block_t);
+	size_t i = pool->vg_merged_len;
 
-	block = pool->alloc_func(&size, pool->context);
+	/* mempools merged into the frame now belong to its parent */
+	while ((i > 0) && (pool->vg_merged[i - 1].depth == depth)) {
+		pool->vg_merged[--i].depth = depth - 1;
+	}
 
-	if (block == NULL) {
-		return NULL;
+	if (anchor == NULL) {
+		PSCA_VG_POOL_DEL(frame);
+		return;
 	}
 
-	/* we requested more than is actually usable by the user */
-	block->size = size - sizeof(psca_block_t);
-	block->prev = prev;
+	if (pool->vg_merged_len == pool->vg_merged_cap) {
+		size_t cap = pool->vg_merged_cap ? pool->vg_merged_cap * 2 : 16;
+		struct psca_vg_merged *merged =
+		    realloc(pool->vg_merged, cap * sizeof(*merged));
 
-	return block;
+		if (merged == NULL) {
+			/* lose track of the allocations rather than the frame */
+			PSCA_VG_POOL_DEL(frame);
+			return;
+		}
+
+		pool->vg_merged = merged;
+		pool->vg_merged_cap = cap;
+	}
+
+	PSCA_VG_POOL_MOVE(frame, anchor);
+
+	pool->vg_merged[pool->vg_merged_len].anchor = anchor;
+	pool->vg_merged[pool->vg_merged_len].depth = depth - 1;
+	pool->vg_merged_len++;
 }
 
-#define PSCA_BLOCK_START(_p) (void *)((uintptr_t)(_p) + sizeof(psca_block_t))
-#define PSCA_POOL_P(_p) ((psca_pool_t *)(_p))
-#define PSCA_FRAME_OVERHEAD (sizeof(psca_frame_t))
+/* destroys the merged mempools owned by frames at or above a depth */
+static void
+psca_vg_release(psca_pool_t *pool,  /* in: the pool */
+                unsigned     depth) /* in: depth of the popped frame */
+{
+	while ((pool->vg_merged_len > 0) &&
+	       (pool->vg_merged[pool->vg_merged_len - 1].depth >= depth)) {
+		pool->vg_merged_len--;
+		PSCA_VG_POOL_DEL(pool->vg_merged[pool->vg_merged_len].anchor);
+	}
+}
+#else
+#define psca_vg_merge(_pool, _f, _a, _d) PSCA_VG_POOL_DEL(_f)
+#define psca_vg_release(_pool, _d)       ((void)0)
+#endif
 
-const void *
-psca_push(psca_t p)
+/* writes out the buffered records of a trace */
+static int
+psca_trace_flush(psca_trace_t *trace) /* in: the trace to flush */
 {
-	psca_pool_t *pool = PSCA_POOL_P(p);
-	psca_frame_t *prev = pool->frames;
-	psca_frame_t *frame;
+	size_t off = 0;
 
-	if ((prev == NULL) || (prev->free < PSCA_FRAME_OVERHEAD)) {
-		/* either this is the first frame in the pool, or there is not enough
-		 * room in the previous frame to store the new frame */
-		psca_block_t *block = psca_block_add(pool, NULL, pool->block_size);
+	while (off < trace->len) {
+		ssize_t n = write(trace->fd, trace->buf + off, trace->len - off);
 
-		if (block == NULL) {
-			return NULL;
-		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
 
-		frame = PSCA_BLOCK_START(block);
-		frame->next = (uint8_t *)((uintptr_t)frame + PSCA_FRAME_OVERHEAD);
-		frame->free = block->size - PSCA_FRAME_OVERHEAD;
-		frame->blocks = block;
-	} else {
-		/* there was enough room in the previous frame's block, so create
-		 * the frame there. */
-		frame = (psca_frame_t *)prev->next;
+			trace->len = 0;
+			return -1;
+		}
 
-		frame->next = prev->next + PSCA_FRAME_OVERHEAD;
-		frame->free = prev->free - PSCA_FRAME_OVERHEAD;
-		frame->blocks = NULL;
+		off += n;
 	}
 
-	frame->prev = prev;
-	pool->frames = frame;
+	trace->len = 0;
 
-	return (void *)frame;
+	return 0;
 }
 
-const void *
-psca_pop(psca_t p)
+/* appends an unsigned LEB128 number to a trace */
+static inline void
+psca_trace_num(psca_trace_t *trace, /* in: the trace */
+               uint64_t      value) /* in: the number */
 {
-	psca_pool_t *pool = PSCA_POOL_P(p);
-	psca_frame_t *frame = pool->frames;
-	psca_block_t *block;
+	while (value >= 0x80) {
+		trace->buf[trace->len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
 
-	pool->frames = frame->prev;
+	trace->buf[trace->len++] = (uint8_t)value;
+}
 
-	block = frame->blocks;
+/* appends a record to the trace of a pool */
+static void
+psca_trace_write(psca_pool_t *pool,  /* in: the pool being traced */
+                 int          op,    /* in: the operation */
+                 int          nargs, /* in: number of arguments, up to 2 */
+                 uint64_t     a,     /* in: first argument */
+                 uint64_t     b)     /* in: second argument */
+{
+	psca_trace_t *trace = pool->trace;
 
-	/* destroy all the blocks the frame owns */
-	while (block) {
-		psca_block_t *prev = block->prev;
+	/* an opcode and two numbers of up to 10 bytes each */
+	if (trace->len + 21 > PSCA_TRACE_BUFFER) {
+		psca_trace_flush(trace);
+	}
 
-		pool->free_func(block, pool->context);
+	trace->buf[trace->len++] = (uint8_t)op;
 
-		block = prev;
+	if (nargs > 0) {
+		psca_trace_num(trace, a);
 	}
 
-	return (void *)frame;
+	if (nargs > 1) {
+		psca_trace_num(trace, b);
+	}
 }
 
-void *
-psca_malloc(psca_t  p,
-            size_t  size)
+#define PSCA_TRACE(_pool, _op, _n, _a, _b) do { \
+	if ((_pool)->trace != NULL) { \
+		psca_trace_write((_pool), (_op), (_n), (_a), (_b)); \
+	} \
+} while (0)
+
+/* copies the counters of a pool to the page it publishes them in */
+static void
+psca_export_update(psca_pool_t *pool) /* in: the pool publishing */
 {
-	psca_pool_t *pool = PSCA_POOL_P(p);
-	void *ptr;
+	psca_export_page_t *page = pool->export;
+	psca_export_t *info = &page->info;
+	unsigned seq = page->seq;
 
-	psca_frame_t *frame = pool->frames;
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 
-	if (frame->free < size) {
-		size_t alloc_size = size;
-		psca_block_t *blocks_head;
+	info->depth = (pool->frames != NULL) ? pool->frames->depth + 1 : 0;
+	info->updates++;
 
-		if (alloc_size < pool->block_size) {
-			alloc_size = pool->block_size;
+	psca_get_stats(pool, &info->stats);
+
+	if (info->stats.block_bytes > info->peak_bytes) {
+		info->peak_bytes = info->stats.block_bytes;
+	}
+
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#define PSCA_EXPORT(_pool) do { \
+	if ((_pool)->export != NULL) { \
+		psca_export_update(_pool); \
+	} \
+} while (0)
+
+/* accounts for a block leaving the pool */
+static inline void
+psca_block_forget(psca_pool_t  *pool,  /* in: the pool that owned the block */
+                  psca_block_t *block) /* in: the block */
+{
+	__atomic_add_fetch(&pool->stats.block_frees, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pool->stats.block_bytes,
+	                   block->size + sizeof(psca_block_t), __ATOMIC_RELAXED);
+}
+
+/* gets a new block from the provider */
+static psca_block_t *
+psca_block_new(psca_pool_t          *pool,    /* in: the pool that owns the block */
+               size_t                size,    /* in: usable size of the block */
+               psca_block_purpose_t  purpose, /* in: what the block is for */
+               unsigned              depth)   /* in: depth of the owning frame */
+{
+	psca_block_t *block;
+	size += sizeof(psca_block_t);
+
+	if (pool->alloc_hint_func != NULL) {
+		psca_alloc_hint_t hint;
+
+		hint.purpose = purpose;
+		hint.depth = depth;
+		hint.alignment = 0;
+
+		/* blocks of the bottom frame and side blocks sit under everything
+		 * else on the stack */
+		if (purpose == PSCA_BLOCK_SPARE) {
+			hint.lifetime = PSCA_LIFETIME_SHORT;
+		} else if ((depth == 0) || (purpose == PSCA_BLOCK_SIDE)) {
+			hint.lifetime = PSCA_LIFETIME_LONG;
 		} else {
-			alloc_size *= pool->growth_factor;
+			hint.lifetime = PSCA_LIFETIME_SHORT;
 		}
 
-		blocks_head = psca_block_add(pool, frame->blocks, alloc_size);
+		hint.name = pool->name;
 
-		if (blocks_head == NULL) {
-			return NULL;
-		}
+		block = pool->alloc_hint_func(&size, &hint, pool->context);
+	} else {
+		block = pool->alloc_func(&size, pool->context);
+	}
 
-		frame->next = PSCA_BLOCK_START(blocks_head);
-		frame->blocks = blocks_head;
-		frame->free = blocks_head->size;
+	if (block == NULL) {
+		return NULL;
 	}
 
-	ptr = frame->next;
+	/* the provider may hand back memory that was poisoned by a previous
+	 * owner, so only the usable part of the block starts out poisoned */
+	PSCA_UNPOISON(block, sizeof(psca_block_t));
 
-	frame->next += size;
-	frame->free -= size;
+	/* we requested more than is actually usable by the user */
+	block->size = size - sizeof(psca_block_t);
+	block->prev = NULL;
 
-	return ptr;
+	PSCA_POISON(block + 1, block->size);
+
+	__atomic_add_fetch(&pool->stats.block_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool->stats.block_bytes, size, __ATOMIC_RELAXED);
+
+	PSCA_PROBE4(block_acquire, pool, block, block->size, depth);
+
+	return block;
 }
 
-/* default implementation of memory allocation */
-static void *
-psca_default_alloc(size_t *size,
-                   void   *context)
+/* adds a block to a chain */
+static inline psca_block_t *
+psca_block_add(psca_pool_t          *pool,    /* in: the pool that owns the block */
+               psca_frame_t         *frame,   /* in: the frame that owns the block */
+               psca_block_t         *prev,    /* in: previous block in the frame */
+               size_t                size,    /* in: usable size of the block */
+               psca_block_purpose_t  purpose) /* in: what the block is for */
 {
-	size_t sz = *size;
-
-	void *block = malloc(sz);
+	psca_block_t *block = psca_block_new(pool, size, purpose, frame->depth);
 
 	if (block == NULL) {
 		return NULL;
 	}
 
-	*size = sz;
+	block->prev = prev;
+	block->seq = pool->block_seq++;
+
+	frame->block_count++;
+	frame->block_bytes += block->size + sizeof(psca_block_t);
+
+	PSCA_TRACE(pool, PSCA_TRACE_BLOCK_ACQUIRE, 1, block->size, 0);
+	PSCA_EXPORT(pool);
 
 	return block;
 }
 
-/* default implementation of memory deallocation */
-static void
-psca_default_free(void   *block,
-                  void   *context)
-{
-	free((void *)block);
-}
+#define PSCA_BLOCK_START(_p) (void *)((uintptr_t)(_p) + sizeof(psca_block_t))
 
-psca_t
-psca_new(void)
+/* hands a block back to its provider. ASan keeps the shadow of memory that
+ * gets unmapped, which would trip up whatever is mapped there next, so the
+ * block goes back unpoisoned as far as ASan is concerned */
+#define PSCA_RELEASE(_b) do { \
+	PSCA_ASAN_UNPOISON((_b), (_b)->size + sizeof(psca_block_t)); \
+	PSCA_VG_NOACCESS(PSCA_BLOCK_START(_b), (_b)->size); \
+} while (0)
+#define PSCA_POOL_P(_p) ((psca_pool_t *)(_p))
+
+/* hands a chain of blocks to the batch deallocation function, returns -1
+ * if the batch could not be built */
+static int
+psca_block_release_batch(psca_pool_t  *pool,  /* in: the pool */
+                         psca_block_t *block) /* in: newest block in the chain */
 {
-	psca_pool_t *pool = malloc(sizeof(psca_pool_t));
-	memset(pool, 0, sizeof(psca_pool_t));
+	psca_block_t *b;
+	size_t count = 0;
 
-	pool->alloc_func = psca_default_alloc;
-	pool->free_func = psca_default_free;
-	pool->block_size = PSCA_POOL_DEFAULT_BLOCK_SIZE;
-	pool->growth_factor = PSCA_POOL_DEFAULT_GROWTH_FACTOR;
+	for (b = block; b != NULL; b = b->prev) {
+		count++;
+	}
 
-	return pool;
+	if (count > pool->batch_cap) {
+		psca_block_info_t *batch = realloc(pool->batch,
+		                                   count * sizeof(*batch));
+
+		if (batch == NULL) {
+			return -1;
+		}
+
+		pool->batch = batch;
+		pool->batch_cap = count;
+	}
+
+	for (b = block, count = 0; b != NULL; b = b->prev, count++) {
+		pool->batch[count].block = b;
+		pool->batch[count].size = b->size + sizeof(psca_block_t);
+
+		PSCA_PROBE3(block_release, pool, b, b->size);
+		PSCA_TRACE(pool, PSCA_TRACE_BLOCK_RELEASE, 1, b->size, 0);
+		psca_block_forget(pool, b);
+		PSCA_RELEASE(b);
+	}
+
+	pool->free_batch_func(pool->batch, count, pool->context);
+
+	PSCA_EXPORT(pool);
+
+	return 0;
 }
 
-int
-psca_destroy(psca_t p)
+/* releases a chain of blocks */
+static inline void
+psca_block_release(psca_pool_t  *pool,  /* in: the pool that owns the blocks */
+                   psca_block_t *block) /* in: newest block in the chain */
 {
-	free((void *)p);
+	if ((pool->free_batch_func != NULL) && (block != NULL) &&
+	    (psca_block_release_batch(pool, block) == 0)) {
+		return;
+	}
 
-	return 0;
+	while (block) {
+		psca_block_t *prev = block->prev;
+
+		PSCA_PROBE3(block_release, pool, block, block->size);
+		PSCA_TRACE(pool, PSCA_TRACE_BLOCK_RELEASE, 1, block->size, 0);
+		psca_block_forget(pool, block);
+		PSCA_RELEASE(block);
+
+		pool->free_func(block, pool->context);
+
+		block = prev;
+	}
+
+	PSCA_EXPORT(pool);
 }
 
-void
-psca_set_funcs(psca_t             p,
-               psca_alloc_func_t  alloc_func,
-               psca_free_func_t   free_func,
-               void              *context)
+/* merges two lists of blocks, from newest to oldest, into one list in the
+ * order the blocks were taken. Returns the newest block of the list */
+static psca_block_t *
+psca_block_merge(psca_block_t *a, /* in: newest block of a list */
+                 psca_block_t *b) /* in: newest block of the other list */
 {
-	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_block_t *head = NULL;
+	psca_block_t **link = &head;
 
-	pool->alloc_func = alloc_func;
-	pool->free_func = free_func;
-	pool->context = context;
+	while ((a != NULL) && (b != NULL)) {
+		if (a->seq > b->seq) {
+			*link = a;
+			a = a->prev;
+		} else {
+			*link = b;
+			b = b->prev;
+		}
+
+		link = &(*link)->prev;
+	}
+
+	/* what is left of the other list is older than everything else */
+	*link = (a != NULL) ? a : b;
+
+	return head;
 }
 
-void
-psca_set_block_size(psca_t p,
-                    size_t value)
+/* adds a list of blocks, from newest to oldest, to a chain. The blocks
+ * must be older than the ones already in the chain, as they are when
+ * frames are popped one after the other */
+static inline void
+psca_chain_add(psca_chain_t *chain, /* in: the chain to add to */
+               psca_block_t *head,  /* in: newest block to add */
+               psca_block_t *tail,  /* in: oldest block to add */
+               psca_frame_t *frame) /* in: the frame that owned them */
 {
-	psca_pool_t *pool = PSCA_POOL_P(p);
+	if (head == NULL) {
+		return;
+	}
 
-	pool->block_size = value;
+	if (chain->head == NULL) {
+		chain->head = head;
+		chain->top = frame->depth;
+	} else {
+		chain->tail->prev = head;
+	}
+
+	tail->prev = NULL;
+	chain->tail = tail;
+	chain->bottom = frame->depth;
+	chain->count += frame->block_count;
+	chain->bytes += frame->block_bytes;
 }
 
-void
-psca_set_growth_factor(psca_t p,
-                       int    value)
+/* queues a job on a reclaimer, which fails if the reclaimer has too much
+ * work queued already */
+static int
+psca_reclaimer_push(psca_reclaimer_thr_t *r,   /* in: the reclaimer */
+                    psca_reclaim_job_t   *job) /* in: the job to queue */
 {
-	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_reclaim_job_t *top;
 
-	pool->growth_factor = value;
+	if (__atomic_add_fetch(&r->pending, 1, __ATOMIC_RELAXED) > r->limit) {
+		__atomic_sub_fetch(&r->pending, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	top = __atomic_load_n(&r->jobs, __ATOMIC_RELAXED);
+
+	do {
+		job->next = top;
+	} while (!__atomic_compare_exchange_n(&r->jobs, &top, job, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* the thread only sleeps once it has found the stack empty */
+	if (top == NULL) {
+		sem_post(&r->wake);
+	}
+
+	return 0;
+}
+
+/* hands a chain of blocks to a reclaimer */
+static int
+psca_reclaimer_submit(psca_reclaimer_thr_t *r,     /* in: the reclaimer */
+                      psca_pool_t          *pool,  /* in: the pool that owns the blocks */
+                      psca_chain_t         *chain) /* in: the blocks to release */
+{
+	psca_reclaim_job_t *job = PSCA_BLOCK_START(chain->head);
+
+	if (chain->head->size < sizeof(psca_reclaim_job_t)) {
+		return -1;
+	}
+
+	PSCA_ASAN_UNPOISON(job, sizeof(psca_reclaim_job_t));
+	PSCA_VG_UNDEFINED(job, sizeof(psca_reclaim_job_t));
+
+	job->free_func = pool->free_func;
+	job->free_batch_func = pool->free_batch_func;
+	job->context = pool->context;
+	job->pool = NULL;
+
+	if (psca_reclaimer_push(r, job) != 0) {
+		PSCA_POISON(job, sizeof(psca_reclaim_job_t));
+		return -1;
+	}
+
+	/* the blocks belong to the reclaimer now, the chain kept their totals
+	 * as it was gathered */
+	__atomic_add_fetch(&pool->stats.block_frees, chain->count, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pool->stats.block_bytes, chain->bytes, __ATOMIC_RELAXED);
+
+	PSCA_EXPORT(pool);
+
+	return 0;
+}
+
+/* fills the empty spare slots of a pool with prefaulted blocks */
+static void
+psca_spare_fill(psca_pool_t *pool) /* in: the pool to fill */
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	int i;
+
+	for (i = 0; i < pool->spare_count; i++) {
+		volatile uint8_t *p;
+		psca_block_t *block;
+		size_t off;
+
+		if (__atomic_load_n(&pool->spares[i], __ATOMIC_RELAXED) != NULL) {
+			continue;
+		}
+
+		block = psca_block_new(pool, pool->block_size, PSCA_BLOCK_SPARE, 0);
+
+		if (block == NULL) {
+			return;
+		}
+
+		/* write to every page so the kernel has to back them now, rather
+		 * than when the pool first allocates from them */
+		p = (volatile uint8_t *)block;
+
+		PSCA_ASAN_UNPOISON(block, block->size + sizeof(psca_block_t));
+		PSCA_VG_UNDEFINED(PSCA_BLOCK_START(block), block->size);
+
+		for (off = page; off < block->size + sizeof(psca_block_t); off += page) {
+			p[off] = 0;
+		}
+
+		PSCA_POISON(PSCA_BLOCK_START(block), block->size);
+
+		__atomic_add_fetch(&pool->stats.prefaulted, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&pool->spares[i], block, __ATOMIC_RELEASE);
+	}
+}
+
+/* gets the spares of a pool refilled on its reclaimer, so neither the
+ * provider call nor the page faults happen on the pool's thread. Without
+ * a reclaimer, or when it is too busy, the spares are left as they are
+ * until the next block is taken */
+static void
+psca_spare_refill(psca_pool_t *pool) /* in: the pool to refill */
+{
+	psca_reclaimer_thr_t *r = pool->reclaimer;
+
+	if (r == NULL) {
+		return;
+	}
+
+	if (__atomic_exchange_n(&pool->spare_queued, 1, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	pool->spare_job.pool = pool;
+
+	if (psca_reclaimer_push(r, &pool->spare_job) != 0) {
+		__atomic_store_n(&pool->spare_queued, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/* takes a prefaulted block from the spares of a pool */
+static psca_block_t *
+psca_spare_take(psca_pool_t *pool) /* in: the pool to take from */
+{
+	psca_block_t *block = NULL;
+	int i;
+
+	for (i = 0; (i < pool->spare_count) && (block == NULL); i++) {
+		if (__atomic_load_n(&pool->spares[i], __ATOMIC_RELAXED) != NULL) {
+			block = __atomic_exchange_n(&pool->spares[i], NULL,
+			                            __ATOMIC_ACQUIRE);
+		}
+	}
+
+	if (block != NULL) {
+		pool->stats.prefault_hits++;
+	} else {
+		pool->stats.prefault_misses++;
+	}
+
+	psca_spare_refill(pool);
+
+	return block;
+}
+
+/* sets a chain of blocks aside on the pending list */
+static inline void
+psca_chain_defer(psca_pool_t  *pool,  /* in: the pool that owns the blocks */
+                 psca_chain_t *chain) /* in: the blocks to set aside */
+{
+#ifdef PSCA_WITH_POISONING
+	psca_block_t *block;
+
+	for (block = chain->head; block != NULL; block = block->prev) {
+		PSCA_POISON(PSCA_BLOCK_START(block), block->size);
+	}
+#endif
+
+	if (pool->pending == NULL) {
+		pool->pending = chain->head;
+		pool->pending_tail = chain->tail;
+		pool->pending_depth = chain->bottom;
+	} else if (chain->top < pool->pending_depth) {
+		/* the stack is still unwinding, so these blocks are older than
+		 * the ones already pending and go after them */
+		pool->pending_tail->prev = chain->head;
+		pool->pending_tail = chain->tail;
+		pool->pending_depth = chain->bottom;
+	} else {
+		/* frames were pushed again since, and their blocks are newer */
+		chain->tail->prev = pool->pending;
+		pool->pending = chain->head;
+
+		if (chain->bottom < pool->pending_depth) {
+			pool->pending_depth = chain->bottom;
+		}
+	}
+}
+
+/* releases up to the release limit of a pool from its pending list, unless
+ * frees are deferred */
+static void
+psca_pending_release(psca_pool_t *pool) /* in: the pool to release from */
+{
+	psca_block_t *head = pool->pending;
+	psca_block_t *last = head;
+	size_t count;
+
+	if ((head == NULL) || pool->defer_free) {
+		return;
+	}
+
+	for (count = 1; (count < pool->release_limit) && (last->prev != NULL); count++) {
+		last = last->prev;
+	}
+
+	pool->pending = last->prev;
+	last->prev = NULL;
+
+	if (pool->pending == NULL) {
+		pool->pending_tail = NULL;
+		pool->pending_depth = 0;
+	}
+
+	psca_block_release(pool, head);
+}
+
+/* releases a chain of blocks, or sets it aside if frees are deferred */
+static inline void
+psca_chain_release(psca_pool_t  *pool,  /* in: the pool that owns the blocks */
+                   psca_chain_t *chain) /* in: the blocks to release */
+{
+	if (chain->head == NULL) {
+		if (pool->release_limit != 0) {
+			psca_pending_release(pool);
+		}
+
+		return;
+	}
+
+	if (pool->defer_free) {
+		psca_chain_defer(pool, chain);
+		return;
+	}
+
+	/* when the reclaimer falls behind, the caller pays for the release */
+	if ((pool->reclaimer != NULL) &&
+	    (psca_reclaimer_submit(pool->reclaimer, pool, chain) == 0)) {
+		return;
+	}
+
+	/* whatever does not fit in the limit is left for later operations */
+	if (pool->release_limit != 0) {
+		psca_chain_defer(pool, chain);
+		psca_pending_release(pool);
+		return;
+	}
+
+	psca_block_release(pool, chain->head);
+}
+
+/* reads the clock used for the histograms, in nanoseconds */
+static inline uint64_t
+psca_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* records how long an operation took, if the pool is timing operations */
+static inline void
+psca_hist_add(psca_pool_t *pool,  /* in: the pool */
+              int          op,    /* in: the operation */
+              uint64_t     start) /* in: when the operation started */
+{
+	psca_histogram_t *hist = &pool->histograms[op];
+	uint64_t ns = psca_clock() - start;
+	int bucket = 0;
+
+	if (ns != 0) {
+		bucket = 63 - __builtin_clzll(ns);
+
+		if (bucket >= PSCA_HIST_BUCKETS) {
+			bucket = PSCA_HIST_BUCKETS - 1;
+		}
+	}
+
+	hist->count++;
+	hist->total_ns += ns;
+	hist->buckets[bucket]++;
+
+	if (ns > hist->max_ns) {
+		hist->max_ns = ns;
+	}
+}
+
+/* picks the number of bytes until the next sample. Gaps are drawn from an
+ * exponential distribution with the sampling interval as its mean, which
+ * is what pprof assumes when it scales samples back up, and which keeps
+ * allocation patterns from aliasing with the interval */
+static size_t
+psca_prof_next(psca_pool_t *pool) /* in: the pool sampling */
+{
+	uint64_t x = pool->sample_rng;
+	double u;
+
+	/* xorshift64 */
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	pool->sample_rng = x;
+
+	/* uniform in (0, 1] */
+	u = (double)((x >> 11) + 1) / (double)(UINT64_C(1) << 53);
+
+	return 1 + (size_t)(-log(u) * (double)pool->sample_interval);
+}
+
+/* finds or adds the entry of a call stack */
+static psca_prof_stack_t *
+psca_prof_lookup(psca_pool_t  *pool,  /* in: the pool sampling */
+                 void        **pcs,   /* in: the program counters */
+                 int           depth) /* in: number of program counters */
+{
+	psca_prof_stack_t *stack;
+	size_t hash = (size_t)depth;
+	int j;
+
+	for (j = 0; j < depth; j++) {
+		hash = (hash ^ (uintptr_t)pcs[j]) * 0x100000001b3ULL;
+	}
+
+	if (pool->prof_len >= pool->prof_cap) {
+		size_t cap = pool->prof_cap ? pool->prof_cap * 2 : PSCA_PROF_MIN_STACKS;
+		psca_prof_stack_t **buckets = calloc(cap, sizeof(psca_prof_stack_t *));
+		size_t i;
+
+		if (buckets == NULL) {
+			return NULL;
+		}
+
+		/* entries are relinked, never moved, since samples point to them */
+		for (i = 0; i < pool->prof_cap; i++) {
+			stack = pool->prof_stacks[i];
+
+			while (stack != NULL) {
+				psca_prof_stack_t *next = stack->next;
+
+				stack->next = buckets[stack->hash & (cap - 1)];
+				buckets[stack->hash & (cap - 1)] = stack;
+
+				stack = next;
+			}
+		}
+
+		free(pool->prof_stacks);
+		pool->prof_stacks = buckets;
+		pool->prof_cap = cap;
+	}
+
+	for (stack = pool->prof_stacks[hash & (pool->prof_cap - 1)]; stack != NULL;
+	     stack = stack->next) {
+		if ((stack->hash == hash) && (stack->depth == depth) &&
+		    (memcmp(stack->pcs, pcs, depth * sizeof(void *)) == 0)) {
+			return stack;
+		}
+	}
+
+	stack = calloc(1, sizeof(psca_prof_stack_t));
+
+	if (stack == NULL) {
+		return NULL;
+	}
+
+	stack->hash = hash;
+	stack->depth = depth;
+	memcpy(stack->pcs, pcs, depth * sizeof(void *));
+
+	stack->next = pool->prof_stacks[hash & (pool->prof_cap - 1)];
+	pool->prof_stacks[hash & (pool->prof_cap - 1)] = stack;
+	pool->prof_len++;
+
+	return stack;
+}
+
+/* records a sampled allocation, or rearms the countdown if sampling is
+ * disabled. This is kept out of line so it can be skipped reliably when
+ * walking the stack. */
+static __attribute__((noinline)) void
+psca_prof_sample(psca_pool_t *pool,  /* in: the pool sampling */
+                 psca_frame_t *frame, /* in: the frame allocated from */
+                 size_t       size,  /* in: size of the allocation */
+                 int          skip)  /* in: wrappers around the allocation function */
+{
+	void *pcs[PSCA_PROF_MAX_DEPTH + 3];
+	psca_prof_stack_t *stack;
+	size_t i;
+	int depth;
+
+	if (pool->sample_interval == 0) {
+		pool->sample_left = SIZE_MAX;
+		return;
+	}
+
+	pool->sample_left = psca_prof_next(pool);
+
+	/* this function, the allocation function and the wrappers around it
+	 * are not interesting */
+	skip += 2;
+	depth = backtrace(pcs, PSCA_PROF_MAX_DEPTH + skip) - skip;
+
+	if (depth <= 0) {
+		return;
+	}
+
+	stack = psca_prof_lookup(pool, pcs + skip, depth);
+
+	if (stack == NULL) {
+		return;
+	}
+
+	if (pool->prof_live_len == pool->prof_live_cap) {
+		size_t cap = pool->prof_live_cap ? pool->prof_live_cap * 2 : PSCA_PROF_MIN_STACKS;
+		psca_prof_live_t *live = realloc(pool->prof_live, cap * sizeof(psca_prof_live_t));
+
+		if (live == NULL) {
+			return;
+		}
+
+		pool->prof_live = live;
+		pool->prof_live_cap = cap;
+	}
+
+	/* samples are kept in the order of the frames they were taken in, and
+	 * psca_malloc_in() takes them below those of the frames on top */
+	for (i = pool->prof_live_len;
+	     (i > 0) && (pool->prof_live[i - 1].depth > frame->depth); i--) {
+	}
+
+	memmove(&pool->prof_live[i + 1], &pool->prof_live[i],
+	        (pool->prof_live_len - i) * sizeof(psca_prof_live_t));
+
+	pool->prof_live[i].stack = stack;
+	pool->prof_live[i].bytes = size;
+	pool->prof_live[i].depth = frame->depth;
+	pool->prof_live_len++;
+
+	stack->allocs++;
+	stack->bytes += size;
+	stack->inuse_allocs++;
+	stack->inuse_bytes += size;
+}
+
+/* retires the samples taken in a frame that is being popped */
+static inline void
+psca_prof_pop(psca_pool_t *pool,  /* in: the pool sampling */
+              unsigned     depth) /* in: depth of the popped frame */
+{
+	while ((pool->prof_live_len != 0) &&
+	       (pool->prof_live[pool->prof_live_len - 1].depth >= depth)) {
+		psca_prof_live_t *live = &pool->prof_live[--pool->prof_live_len];
+
+		live->stack->inuse_allocs--;
+		live->stack->inuse_bytes -= live->bytes;
+	}
+}
+
+/* hands the samples taken in a frame being merged over to its parent */
+static inline void
+psca_prof_merge(psca_pool_t *pool,  /* in: the pool sampling */
+                unsigned     depth) /* in: depth of the merged frame */
+{
+	size_t i = pool->prof_live_len;
+
+	while ((i > 0) && (pool->prof_live[i - 1].depth == depth)) {
+		pool->prof_live[--i].depth = depth - 1;
+	}
+}
+
+/* finds the node of a label under another node */
+static psca_flame_node_t *
+psca_flame_child(psca_flame_node_t *parent, /* in: the parent node */
+                 const char        *label)  /* in: label of the child */
+{
+	psca_flame_node_t *node;
+
+	for (node = parent->child; node != NULL; node = node->sibling) {
+		if (node->label == label) {
+			return node;
+		}
+	}
+
+	node = calloc(1, sizeof(psca_flame_node_t));
+
+	if (node == NULL) {
+		return parent;
+	}
+
+	node->label = label;
+	node->parent = parent;
+	node->sibling = parent->child;
+	parent->child = node;
+
+	return node;
+}
+
+/* accounts a frame leaving the stack, by a pop or a merge, to its node. A
+ * frame's peak is the most it ever had live at once, nested frames
+ * included, so it is carried up to the parent as the frame goes away */
+static inline void
+psca_flame_leave(psca_frame_t *frame,  /* in: the frame leaving */
+                 int           popped) /* in: whether its memory goes away */
+{
+	psca_flame_node_t *node = frame->flame;
+	size_t peak = frame->peak > frame->used ? frame->peak : frame->used;
+
+	if (popped) {
+		node->total += frame->used;
+
+		if (peak > node->peak) {
+			node->peak = peak;
+		}
+	}
+
+	if ((frame->prev != NULL) && (frame->prev->flame != NULL) &&
+	    (frame->prev->used + peak > frame->prev->peak)) {
+		frame->prev->peak = frame->prev->used + peak;
+	}
+}
+
+/* finds the profile for a frame about to be pushed */
+static psca_profile_t *
+psca_profile_get(psca_pool_t *pool,  /* in: the pool the frame is in */
+                 const char  *label, /* in: label of the frame, or NULL */
+                 unsigned     depth) /* in: depth of the frame */
+{
+	psca_profile_t *profile;
+	uintptr_t hash;
+
+	if (label != NULL) {
+		/* labels are static strings, so the address identifies them */
+		hash = (uintptr_t)label;
+		hash ^= hash >> 17;
+		hash *= 0x9e3779b1U;
+		hash ^= hash >> 13;
+		depth = 0;
+	} else {
+		hash = depth;
+	}
+
+	profile = &pool->profiles[hash % PSCA_POOL_PROFILES];
+
+	if ((profile->label != label) || (profile->depth != depth)) {
+		profile->label = label;
+		profile->depth = depth;
+		profile->expected = 0;
+	}
+
+	return profile;
+}
+
+/* folds the usage of a popped frame into its profile */
+static inline void
+psca_profile_update(psca_frame_t *frame)
+{
+	psca_profile_t *profile = frame->profile;
+
+	if (profile == NULL) {
+		return;
+	}
+
+	/* follow growth right away, but only shrink by a quarter of the
+	 * difference each time so a single small frame does not undo it */
+	if (frame->used >= profile->expected) {
+		profile->expected = frame->used;
+	} else {
+		profile->expected -= (profile->expected - frame->used) / 4;
+	}
+}
+
+const void *
+psca_push(psca_t p)
+{
+	return psca_push_label(p, NULL);
+}
+
+/* finds the record for a frame about to be pushed */
+static psca_frame_t *
+psca_frame_slot(psca_pool_t *pool) /* in: the pool to push onto */
+{
+	psca_frame_chunk_t *chunk = pool->chunk;
+	psca_frame_t *prev = pool->frames;
+
+	if ((prev != NULL) && (prev + 1 < chunk->frames + PSCA_POOL_FRAME_CHUNK)) {
+		return prev + 1;
+	}
+
+	if ((prev != NULL) || (chunk == NULL)) {
+		/* the current chunk is full (or there is none yet), move on to the
+		 * next one, allocating it the first time the stack gets this deep */
+		psca_frame_chunk_t *next = (chunk != NULL) ? chunk->next : NULL;
+
+		if (next == NULL) {
+			next = malloc(sizeof(psca_frame_chunk_t));
+
+			if (next == NULL) {
+				return NULL;
+			}
+
+			next->prev = chunk;
+			next->next = NULL;
+
+			if (chunk != NULL) {
+				chunk->next = next;
+			}
+		}
+
+		pool->chunk = chunk = next;
+	}
+
+	return chunk->frames;
+}
+
+/* removes the record of the top-most frame from the stack */
+static inline void
+psca_frame_unlink(psca_pool_t  *pool,  /* in: the pool to pop from */
+                  psca_frame_t *frame) /* in: the top-most frame */
+{
+	if ((frame == pool->chunk->frames) && (pool->chunk->prev != NULL)) {
+		pool->chunk = pool->chunk->prev;
+	}
+
+	pool->frames = frame->prev;
+}
+
+const void *
+psca_push_label(psca_t      p,
+                const char *label)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	uint64_t start = pool->timing ? psca_clock() : 0;
+	psca_frame_t *prev = pool->frames;
+	psca_frame_t *frame = psca_frame_slot(pool);
+
+	if (frame == NULL) {
+		return NULL;
+	}
+
+	if ((pool->pending != NULL) && (pool->release_limit != 0)) {
+		psca_pending_release(pool);
+	}
+
+	/* the frame starts out allocating right where its parent is */
+	if (prev != NULL) {
+		frame->next = prev->next;
+		frame->free = prev->free;
+		frame->depth = prev->depth + 1;
+	} else {
+		frame->next = NULL;
+		frame->free = 0;
+		frame->depth = 0;
+	}
+
+	frame->blocks = NULL;
+	frame->first = NULL;
+	frame->prev = prev;
+	frame->side = NULL;
+	frame->side_free = 0;
+	frame->used = 0;
+	frame->first_size = 0;
+	frame->block_count = 0;
+	frame->block_bytes = 0;
+	frame->profile = NULL;
+	frame->flame = NULL;
+	frame->peak = 0;
+
+	if (pool->flame_enabled) {
+		psca_flame_node_t *parent = &pool->flame_root;
+
+		if ((prev != NULL) && (prev->flame != NULL)) {
+			parent = prev->flame;
+		}
+
+		frame->flame = (label != NULL) ? psca_flame_child(parent, label) : parent;
+	}
+
+	if (pool->adaptive_limit != 0) {
+		psca_profile_t *profile = psca_profile_get(pool, label, frame->depth);
+		size_t expected = profile->expected;
+
+		frame->profile = profile;
+
+		/* unless what the frame is expected to use is left in the parent,
+		 * give it a first block that fits it as soon as it allocates */
+		if ((expected != 0) && (frame->free < expected)) {
+			if (expected < PSCA_POOL_MIN_ADAPTIVE_SIZE) {
+				expected = PSCA_POOL_MIN_ADAPTIVE_SIZE;
+			} else if (expected > pool->adaptive_limit) {
+				expected = pool->adaptive_limit;
+			}
+
+			frame->free = 0;
+			frame->first_size = expected;
+		}
+	}
+
+	pool->frames = frame;
+
+	PSCA_VG_POOL_NEW(frame);
+	PSCA_EXPORT(pool);
+
+	if (pool->timing) {
+		psca_hist_add(pool, PSCA_HIST_PUSH, start);
+	}
+
+	PSCA_PROBE3(push, pool, frame, frame->depth);
+	PSCA_TRACE(pool, PSCA_TRACE_PUSH, 1, (uintptr_t)label, 0);
+
+	return (void *)frame;
+}
+
+/* removes the top-most frame from the stack, adding the blocks it owned
+ * to a chain for the caller to release */
+static psca_frame_t *
+psca_frame_pop(psca_pool_t  *pool,  /* in: the pool to pop from */
+               psca_chain_t *chain) /* in: chain collecting the blocks */
+{
+	psca_frame_t *frame = pool->frames;
+
+	PSCA_PROBE4(pop, pool, frame, frame->used, frame->depth);
+	PSCA_TRACE(pool, PSCA_TRACE_POP, 0, 0, 0);
+
+	psca_frame_unlink(pool, frame);
+
+	/* side blocks are acquired while other frames sit on top of the
+	 * frame, so they are interleaved with its own blocks */
+	if (frame->side != NULL) {
+		psca_block_t *tail = frame->side;
+
+		while (tail->prev != NULL) {
+			tail = tail->prev;
+		}
+
+		if ((frame->first != NULL) && (frame->first->seq < tail->seq)) {
+			tail = frame->first;
+		}
+
+		psca_chain_add(chain, psca_block_merge(frame->blocks, frame->side),
+		               tail, frame);
+	} else {
+		psca_chain_add(chain, frame->blocks, frame->first, frame);
+	}
+
+	psca_profile_update(frame);
+
+	if (frame->flame != NULL) {
+		psca_flame_leave(frame, 1);
+	}
+
+	if (pool->prof_live_len != 0) {
+		psca_prof_pop(pool, frame->depth);
+	}
+
+	PSCA_VG_POOL_DEL(frame);
+	psca_vg_release(pool, frame->depth);
+
+	/* everything the frame used in its parent's block is free space again */
+	if (frame->prev != NULL) {
+		PSCA_POISON(frame->prev->next, frame->prev->free);
+	}
+
+	return frame;
+}
+
+const void *
+psca_pop(psca_t p)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	uint64_t start = pool->timing ? psca_clock() : 0;
+	psca_chain_t chain = { NULL, NULL, 0, 0, 0, 0 };
+	psca_frame_t *frame = psca_frame_pop(pool, &chain);
+
+	/* destroy all the blocks the frame owns */
+	psca_chain_release(pool, &chain);
+
+	PSCA_EXPORT(pool);
+
+	if (pool->timing) {
+		psca_hist_add(pool, PSCA_HIST_POP, start);
+	}
+
+	return (void *)frame;
+}
+
+const void *
+psca_pop_to(psca_t      p,
+            const void *f)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	uint64_t start = pool->timing ? psca_clock() : 0;
+	psca_chain_t chain = { NULL, NULL, 0, 0, 0, 0 };
+	psca_frame_t *frame;
+
+	/* make sure the frame is on the stack before unwinding anything */
+	for (frame = pool->frames; frame != f; frame = frame->prev) {
+		if (frame == NULL) {
+			return NULL;
+		}
+	}
+
+	/* the blocks of every frame are gathered and released in one pass */
+	do {
+		frame = psca_frame_pop(pool, &chain);
+	} while (frame != f);
+
+	psca_chain_release(pool, &chain);
+
+	PSCA_EXPORT(pool);
+
+	if (pool->timing) {
+		psca_hist_add(pool, PSCA_HIST_POP, start);
+	}
+
+	return (void *)frame;
+}
+
+size_t
+psca_drain(psca_t p)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_block_t *pending = pool->pending;
+	psca_block_t *block;
+	size_t count = 0;
+
+	pool->pending = NULL;
+	pool->pending_tail = NULL;
+	pool->pending_depth = 0;
+
+	for (block = pending; block != NULL; block = block->prev) {
+		count++;
+	}
+
+	psca_block_release(pool, pending);
+
+	return count;
+}
+
+const void *
+psca_pop_retain(psca_t   p,
+                void   **ptrs,
+                size_t  *sizes,
+                size_t   n)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_chain_t chain = { NULL, NULL, 0, 0, 0, 0 };
+	psca_frame_t *frame;
+	uint8_t *scratch;
+	uint8_t *dest;
+	size_t total = 0;
+	size_t offset = 0;
+	size_t i;
+
+	if (pool->frames->prev == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		total += sizes[i];
+	}
+
+	/* nothing to move, and psca_malloc() would fail on a zero size */
+	if (total == 0) {
+		for (i = 0; i < n; i++) {
+			ptrs[i] = NULL;
+		}
+
+		return psca_pop(p);
+	}
+
+	/* gather the retained allocations at the top of the frame first. Once
+	 * the frame is popped, the parent's copy starts where the frame did,
+	 * which is below the gathered one whenever the two overlap, so a
+	 * single memmove() is enough to move them */
+	scratch = psca_malloc(p, total);
+
+	if (scratch == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		memcpy(scratch + offset, ptrs[i], sizes[i]);
+		offset += sizes[i];
+	}
+
+	frame = psca_frame_pop(pool, &chain);
+
+	dest = psca_malloc(p, total);
+
+	if (dest != NULL) {
+		PSCA_ASAN_UNPOISON(scratch, total);
+		PSCA_VG_DEFINED(scratch, total);
+
+		memmove(dest, scratch, total);
+
+		PSCA_POISON(scratch, total);
+		PSCA_ASAN_UNPOISON(dest, total);
+		PSCA_VG_DEFINED(dest, total);
+	}
+
+	for (i = 0, offset = 0; i < n; i++) {
+		ptrs[i] = (dest != NULL) ? dest + offset : NULL;
+		offset += sizes[i];
+	}
+
+	psca_chain_release(pool, &chain);
+
+	PSCA_EXPORT(pool);
+
+	return (void *)frame;
+}
+
+/* adds a block of `size` bytes to a frame and makes it the current block */
+static int
+psca_frame_add_block(psca_pool_t          *pool,    /* in: the pool the frame is in */
+                     psca_frame_t         *frame,   /* in: the frame to add to */
+                     size_t                size,    /* in: usable size of the block */
+                     psca_block_purpose_t  purpose) /* in: what the block is for */
+{
+	psca_block_t *blocks_head = NULL;
+
+	if ((pool->spare_count != 0) && (size <= pool->block_size) &&
+	    ((purpose == PSCA_BLOCK_FIRST) || (purpose == PSCA_BLOCK_GROWTH))) {
+		blocks_head = psca_spare_take(pool);
+	}
+
+	if (blocks_head != NULL) {
+		blocks_head->prev = frame->blocks;
+		blocks_head->seq = pool->block_seq++;
+
+		frame->block_count++;
+		frame->block_bytes += blocks_head->size + sizeof(psca_block_t);
+	} else {
+		blocks_head = psca_block_add(pool, frame, frame->blocks, size, purpose);
+
+		if (blocks_head == NULL) {
+			return -1;
+		}
+	}
+
+	if (frame->blocks == NULL) {
+		frame->first = blocks_head;
+	}
+
+	frame->next = PSCA_BLOCK_START(blocks_head);
+	frame->blocks = blocks_head;
+	frame->free = blocks_head->size;
+
+	return 0;
+}
+
+const void *
+psca_merge(psca_t p)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_frame_t *frame = pool->frames;
+	psca_frame_t *parent = frame->prev;
+#ifdef PSCA_WITH_VALGRIND
+	const void *anchor = NULL;
+#endif
+
+	if (parent == NULL) {
+		return NULL;
+	}
+
+	PSCA_TRACE(pool, PSCA_TRACE_MERGE, 0, 0, 0);
+
+#ifdef PSCA_WITH_VALGRIND
+	/* the frame's record is about to be reused, so its mempool needs a new
+	 * anchor that stays unique until the parent is popped: a byte of the
+	 * frame's own memory does */
+	if (frame->used != 0) {
+		anchor = psca_malloc(p, 1);
+	}
+#endif
+
+	psca_profile_update(frame);
+
+	/* the frame's blocks go on top of the parent's, so the parent carries
+	 * on allocating from where the frame left off */
+	if (frame->blocks != NULL) {
+		frame->first->prev = parent->blocks;
+
+		if (parent->blocks == NULL) {
+			parent->first = frame->first;
+		}
+
+		parent->blocks = frame->blocks;
+	}
+
+	/* the parent may have taken side blocks while the frame was on the
+	 * stack too. The parent's side state only changes if the frame's
+	 * newest side block is the newest of all */
+	if (frame->side != NULL) {
+		parent->side = psca_block_merge(frame->side, parent->side);
+
+		if (parent->side == frame->side) {
+			parent->side_next = frame->side_next;
+			parent->side_free = frame->side_free;
+		}
+	}
+
+	if (frame->flame != NULL) {
+		psca_flame_leave(frame, 0);
+	}
+
+	if (pool->prof_live_len != 0) {
+		psca_prof_merge(pool, frame->depth);
+	}
+
+	/* unless the frame acquired blocks or allocated, where the parent is
+	 * allocating from has not changed */
+	if ((frame->blocks != NULL) || (frame->next != parent->next)) {
+		parent->next = frame->next;
+		parent->free = frame->free;
+	}
+
+	parent->used += frame->used;
+	parent->block_count += frame->block_count;
+	parent->block_bytes += frame->block_bytes;
+
+	if (frame->used != 0) {
+		psca_vg_merge(pool, frame, anchor, frame->depth);
+	} else {
+		PSCA_VG_POOL_DEL(frame);
+		psca_vg_release(pool, frame->depth);
+	}
+
+	psca_frame_unlink(pool, frame);
+
+	PSCA_EXPORT(pool);
+
+	return (void *)frame;
+}
+
+/* gives a frame a new block with room for at least `size` bytes */
+static int
+psca_frame_grow(psca_pool_t  *pool,  /* in: the pool the frame is in */
+                psca_frame_t *frame, /* in: the frame to grow */
+                size_t        size)  /* in: bytes needed in the frame */
+{
+	uint64_t start = pool->timing ? psca_clock() : 0;
+	size_t alloc_size = size;
+	psca_block_purpose_t purpose = PSCA_BLOCK_FIRST;
+	int ret;
+
+	if ((pool->pending != NULL) && (pool->release_limit != 0)) {
+		psca_pending_release(pool);
+	}
+
+	PSCA_PROBE4(grow, pool, frame, size, frame->depth);
+
+	if ((frame->blocks == NULL) && (frame->first_size != 0)) {
+		/* the frame's profile says how large its first block should be */
+		if (alloc_size < frame->first_size) {
+			alloc_size = frame->first_size;
+		}
+	} else if (alloc_size < pool->block_size) {
+		alloc_size = pool->block_size;
+
+		if (frame->blocks != NULL) {
+			purpose = PSCA_BLOCK_GROWTH;
+		}
+
+		/* each block a frame adds is larger than its previous one, so the
+		 * number of blocks only grows logarithmically with the frame */
+		if ((pool->block_growth > 1) && (frame->blocks != NULL)) {
+			size_t grown = pool->max_block_size;
+
+			if (frame->blocks->size < grown / pool->block_growth) {
+				grown = frame->blocks->size * pool->block_growth;
+			}
+
+			if (grown > alloc_size) {
+				alloc_size = grown;
+			}
+		}
+	} else {
+		alloc_size *= pool->growth_factor;
+		purpose = PSCA_BLOCK_LARGE;
+	}
+
+	ret = psca_frame_add_block(pool, frame, alloc_size, purpose);
+
+	if (pool->timing) {
+		psca_hist_add(pool, PSCA_HIST_GROW, start);
+	}
+
+	return ret;
+}
+
+/* allocates from the top-most frame. This is inlined into every public
+ * allocation function, so the sampling profiler finds their callers
+ * right above them on the stack */
+static inline __attribute__((always_inline)) void *
+psca_frame_malloc(psca_pool_t *pool, /* in: the pool to allocate from */
+                  size_t       size, /* in: number of bytes to allocate */
+                  int          skip) /* in: wrappers around the public function */
+{
+	void *ptr;
+
+	psca_frame_t *frame = pool->frames;
+	size_t used = size + PSCA_REDZONE(pool);
+
+	if (frame->free < used) {
+		if (psca_frame_grow(pool, frame, used) != 0) {
+			return NULL;
+		}
+	}
+
+	ptr = frame->next;
+
+	frame->next += used;
+	frame->free -= used;
+	frame->used += used;
+
+	PSCA_TRACE(pool, PSCA_TRACE_MALLOC, 1, size, 0);
+
+	/* the countdown never runs out while sampling is disabled */
+	if (pool->sample_left <= used) {
+		psca_prof_sample(pool, frame, size, skip);
+	} else {
+		pool->sample_left -= used;
+	}
+
+	PSCA_ASAN_UNPOISON(ptr, size);
+	PSCA_VG_POOL_ALLOC(frame, ptr, size);
+
+	return ptr;
+}
+
+void *
+psca_malloc(psca_t  p,
+            size_t  size)
+{
+	return psca_frame_malloc(PSCA_POOL_P(p), size, 0);
+}
+
+void *
+psca_malloc_wrapped(psca_t  p,
+                    size_t  size)
+{
+	return psca_frame_malloc(PSCA_POOL_P(p), size, 1);
+}
+
+void *
+psca_malloc_in(psca_t      p,
+               const void *f,
+               size_t      size)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_frame_t *frame = (psca_frame_t *)f;
+	size_t used = size + PSCA_REDZONE(pool);
+	void *ptr;
+
+	if (frame == pool->frames) {
+		return psca_frame_malloc(pool, size, 0);
+	}
+
+	PSCA_TRACE(pool, PSCA_TRACE_MALLOC_IN, 2,
+	           pool->frames->depth - frame->depth, size);
+
+	if (frame->side_free < used) {
+		size_t alloc_size = used;
+		psca_block_t *side;
+
+		if (alloc_size < pool->block_size) {
+			alloc_size = pool->block_size;
+		} else {
+			alloc_size *= pool->growth_factor;
+		}
+
+		side = psca_block_add(pool, frame, frame->side, alloc_size,
+		                      PSCA_BLOCK_SIDE);
+
+		if (side == NULL) {
+			return NULL;
+		}
+
+		frame->side = side;
+		frame->side_next = PSCA_BLOCK_START(side);
+		frame->side_free = side->size;
+	}
+
+	ptr = frame->side_next;
+
+	frame->side_next += used;
+	frame->side_free -= used;
+	frame->used += used;
+
+	if (pool->sample_left <= used) {
+		psca_prof_sample(pool, frame, size, 0);
+	} else {
+		pool->sample_left -= used;
+	}
+
+	PSCA_ASAN_UNPOISON(ptr, size);
+	PSCA_VG_POOL_ALLOC(frame, ptr, size);
+
+	return ptr;
+}
+
+int
+psca_reserve(psca_t p,
+             size_t size)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_frame_t *frame = pool->frames;
+
+	PSCA_TRACE(pool, PSCA_TRACE_RESERVE, 1, size, 0);
+
+	if (frame->free >= size) {
+		return 0;
+	}
+
+	/* the caller knows what it needs, so neither the growth factor nor the
+	 * block growth apply */
+	if (size < pool->block_size) {
+		size = pool->block_size;
+	}
+
+	return psca_frame_add_block(pool, frame, size, PSCA_BLOCK_RESERVE);
+}
+
+void *
+psca_begin_write(psca_t p,
+                 size_t size)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_frame_t *frame;
+
+	if (psca_reserve(p, size + PSCA_REDZONE(pool)) != 0) {
+		return NULL;
+	}
+
+	frame = pool->frames;
+	pool->write_size = size;
+
+	/* nothing is allocated until the write is committed, the room is only
+	 * made accessible */
+	PSCA_ASAN_UNPOISON(frame->next, size);
+	PSCA_VG_POOL_ALLOC(frame, frame->next, size);
+
+	return frame->next;
+}
+
+void *
+psca_commit(psca_t p,
+            size_t size)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_frame_t *frame = pool->frames;
+	void *ptr = frame->next;
+	size_t used;
+
+	/* never take more than psca_begin_write() made room for */
+	if (size > pool->write_size) {
+		size = pool->write_size;
+	}
+
+	pool->write_size = 0;
+
+	PSCA_TRACE(pool, PSCA_TRACE_COMMIT, 1, size, 0);
+
+	if (size == 0) {
+		PSCA_VG_POOL_FREE(frame, ptr);
+		PSCA_POISON(ptr, frame->free);
+		return ptr;
+	}
+
+	PSCA_VG_POOL_RESIZE(frame, ptr, size);
+
+	used = size + PSCA_REDZONE(pool);
+
+	frame->next += used;
+	frame->free -= used;
+	frame->used += used;
+
+	/* the unwritten tail goes back to being free space */
+	PSCA_POISON((uint8_t *)ptr + size, PSCA_REDZONE(pool) + frame->free);
+
+	return ptr;
+}
+
+/* default implementation of memory allocation */
+static void *
+psca_default_alloc(size_t *size,
+                   void   *context)
+{
+	size_t sz = *size;
+
+	void *block = malloc(sz);
+
+	if (block == NULL) {
+		return NULL;
+	}
+
+	*size = sz;
+
+	return block;
+}
+
+/* default implementation of memory deallocation */
+static void
+psca_default_free(void   *block,
+                  void   *context)
+{
+	free((void *)block);
+}
+
+/* releases the blocks of a job on the reclaimer's pool */
+static void
+psca_reclaimer_run(psca_reclaimer_thr_t *r,   /* in: the reclaimer */
+                   psca_reclaim_job_t   *job) /* in: the jobs to run */
+{
+	while (job != NULL) {
+		psca_reclaim_job_t *next = job->next;
+
+		if (job->pool != NULL) {
+			psca_spare_fill(job->pool);
+			__atomic_store_n(&job->pool->spare_queued, 0, __ATOMIC_RELEASE);
+			__atomic_sub_fetch(&r->pending, 1, __ATOMIC_RELEASE);
+
+			job = next;
+			continue;
+		}
+
+		r->pool.free_func = job->free_func;
+		r->pool.free_batch_func = job->free_batch_func;
+		r->pool.context = job->context;
+
+		psca_block_release(&r->pool, (psca_block_t *)job - 1);
+
+		__atomic_sub_fetch(&r->pending, 1, __ATOMIC_RELEASE);
+
+		job = next;
+	}
+}
+
+/* body of the reclaimer thread */
+static void *
+psca_reclaimer_thread(void *arg)
+{
+	psca_reclaimer_thr_t *r = PSCA_RECLAIMER_P(arg);
+
+	for (;;) {
+		psca_reclaim_job_t *jobs = __atomic_exchange_n(&r->jobs, NULL,
+		                                               __ATOMIC_ACQUIRE);
+
+		if (jobs != NULL) {
+			psca_reclaimer_run(r, jobs);
+		} else if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		} else {
+			sem_wait(&r->wake);
+		}
+	}
+
+	return NULL;
+}
+
+psca_reclaimer_t
+psca_reclaimer_new(size_t limit)
+{
+	psca_reclaimer_thr_t *r = malloc(sizeof(psca_reclaimer_thr_t));
+
+	if (r == NULL) {
+		return NULL;
+	}
+
+	memset(r, 0, sizeof(psca_reclaimer_thr_t));
+
+	r->limit = (limit != 0) ? limit : PSCA_RECLAIMER_DEFAULT_LIMIT;
+
+	if (sem_init(&r->wake, 0, 0) != 0) {
+		goto fail_free;
+	}
+
+	if (pthread_create(&r->thread, NULL, psca_reclaimer_thread, r) != 0) {
+		goto fail_sem;
+	}
+
+	return r;
+
+fail_sem:
+	sem_destroy(&r->wake);
+fail_free:
+	free(r);
+
+	return NULL;
+}
+
+int
+psca_reclaimer_destroy(psca_reclaimer_t p)
+{
+	psca_reclaimer_thr_t *r = PSCA_RECLAIMER_P(p);
+
+	if (r == NULL) {
+		return -1;
+	}
+
+	__atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&r->wake);
+	pthread_join(r->thread, NULL);
+
+	/* jobs pushed while the thread was on its way out */
+	psca_reclaimer_run(r, r->jobs);
+
+	sem_destroy(&r->wake);
+	free(r->pool.batch);
+	free(r);
+
+	return 0;
+}
+
+size_t
+psca_reclaimer_pending(psca_reclaimer_t p)
+{
+	psca_reclaimer_thr_t *r = PSCA_RECLAIMER_P(p);
+
+	return __atomic_load_n(&r->pending, __ATOMIC_ACQUIRE);
+}
+
+int
+psca_set_prefault(psca_t p,
+                  int    count)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	int i;
+
+	if ((count < 0) || (count > PSCA_POOL_MAX_SPARES)) {
+		return -1;
+	}
+
+	if ((count != 0) && (pool->reclaimer == NULL)) {
+		return -1;
+	}
+
+	while (__atomic_load_n(&pool->spare_queued, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+
+	for (i = count; i < pool->spare_count; i++) {
+		if (pool->spares[i] != NULL) {
+			psca_block_release(pool, pool->spares[i]);
+			pool->spares[i] = NULL;
+		}
+	}
+
+	pool->spare_count = count;
+
+	psca_spare_fill(pool);
+
+	return 0;
+}
+
+int
+psca_get_stats(psca_t        p,
+               psca_stats_t *stats)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	stats->block_allocs = __atomic_load_n(&pool->stats.block_allocs,
+	                                      __ATOMIC_RELAXED);
+	stats->prefaulted = __atomic_load_n(&pool->stats.prefaulted,
+	                                    __ATOMIC_RELAXED);
+	stats->prefault_hits = pool->stats.prefault_hits;
+	stats->prefault_misses = pool->stats.prefault_misses;
+	stats->block_frees = __atomic_load_n(&pool->stats.block_frees,
+	                                     __ATOMIC_RELAXED);
+	stats->block_bytes = __atomic_load_n(&pool->stats.block_bytes,
+	                                     __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void
+psca_set_timing(psca_t p,
+                int    value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	if (value && !pool->timing) {
+		memset(pool->histograms, 0, sizeof(pool->histograms));
+	}
+
+	pool->timing = value;
+}
+
+int
+psca_get_histogram(psca_t            p,
+                   int               op,
+                   psca_histogram_t *hist)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	if ((op < 0) || (op >= PSCA_HIST_COUNT)) {
+		return -1;
+	}
+
+	*hist = pool->histograms[op];
+
+	return 0;
+}
+
+void
+psca_set_sampling(psca_t p,
+                  size_t interval)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->sample_interval = interval;
+
+	if (interval == 0) {
+		pool->sample_left = SIZE_MAX;
+		return;
+	}
+
+	if (pool->sample_rng == 0) {
+		pool->sample_rng = ((uintptr_t)pool ^ psca_clock()) | 1;
+	}
+
+	pool->sample_left = psca_prof_next(pool);
+}
+
+int
+psca_write_profile(psca_t p,
+                   int    fd)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_prof_stack_t *stack;
+	size_t inuse_allocs = 0;
+	size_t inuse_bytes = 0;
+	size_t allocs = 0;
+	size_t bytes = 0;
+	char line[512];
+	FILE *maps;
+	size_t i;
+	int j;
+
+	for (i = 0; i < pool->prof_cap; i++) {
+		for (stack = pool->prof_stacks[i]; stack != NULL; stack = stack->next) {
+			inuse_allocs += stack->inuse_allocs;
+			inuse_bytes += stack->inuse_bytes;
+			allocs += stack->allocs;
+			bytes += stack->bytes;
+		}
+	}
+
+	/* the legacy heap profile format, which pprof still reads. heap_v2
+	 * tells it how to scale the samples back up */
+	if (dprintf(fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+	            inuse_allocs, inuse_bytes, allocs, bytes,
+	            pool->sample_interval) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < pool->prof_cap; i++) {
+		for (stack = pool->prof_stacks[i]; stack != NULL; stack = stack->next) {
+			dprintf(fd, "%zu: %zu [%zu: %zu] @", stack->inuse_allocs,
+			        stack->inuse_bytes, stack->allocs, stack->bytes);
+
+			for (j = 0; j < stack->depth; j++) {
+				dprintf(fd, " %p", stack->pcs[j]);
+			}
+
+			dprintf(fd, "\n");
+		}
+	}
+
+	/* lets pprof symbolize the addresses */
+	dprintf(fd, "\nMAPPED_LIBRARIES:\n");
+
+	maps = fopen("/proc/self/maps", "r");
+
+	if (maps != NULL) {
+		while (fgets(line, sizeof(line), maps) != NULL) {
+			dprintf(fd, "%s", line);
+		}
+
+		fclose(maps);
+	}
+
+	return 0;
+}
+
+/* frees the nodes under a node */
+static void
+psca_flame_free(psca_flame_node_t *root) /* in: the node to free under */
+{
+	psca_flame_node_t *node = root->child;
+
+	/* free the tree leaves first, without recursing */
+	while (node != NULL) {
+		if (node->child != NULL) {
+			node = node->child;
+		} else {
+			psca_flame_node_t *parent = node->parent;
+
+			parent->child = node->sibling;
+			free(node);
+
+			node = (parent == root) ? root->child : parent;
+		}
+	}
+}
+
+void
+psca_set_flamegraph(psca_t p,
+                    int    value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->flame_enabled = value;
+}
+
+/* gets the value of a node in a folded stack export */
+static size_t
+psca_flame_value(psca_flame_node_t *node, /* in: the node */
+                 int                what) /* in: the value to get */
+{
+	psca_flame_node_t *child;
+	size_t nested = 0;
+
+	if (what == PSCA_FLAME_TOTAL) {
+		return node->total;
+	}
+
+	/* flamegraphs add up nested values, so only count what the nested
+	 * frames' peaks do not account for */
+	for (child = node->child; child != NULL; child = child->sibling) {
+		nested += child->peak;
+	}
+
+	return (node->peak > nested) ? node->peak - nested : 0;
+}
+
+/* writes the label path of a node */
+static void
+psca_flame_path(int                fd,   /* in: the descriptor to write to */
+                psca_flame_node_t *node) /* in: the node */
+{
+	if (node->parent->parent != NULL) {
+		psca_flame_path(fd, node->parent);
+		dprintf(fd, ";");
+	}
+
+	dprintf(fd, "%s", node->label);
+}
+
+int
+psca_write_flamegraph(psca_t p,
+                      int    fd,
+                      int    what)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_flame_node_t *root = &pool->flame_root;
+	psca_flame_node_t *node;
+	size_t value;
+
+	if ((what != PSCA_FLAME_TOTAL) && (what != PSCA_FLAME_PEAK)) {
+		return -1;
+	}
+
+	/* bytes allocated outside of any labeled frame */
+	value = psca_flame_value(root, what);
+
+	if (value != 0) {
+		dprintf(fd, "[unlabeled] %zu\n", value);
+	}
+
+	/* depth-first, without recursing */
+	for (node = root->child; node != NULL; ) {
+		value = psca_flame_value(node, what);
+
+		if (value != 0) {
+			psca_flame_path(fd, node);
+			dprintf(fd, " %zu\n", value);
+		}
+
+		if (node->child != NULL) {
+			node = node->child;
+			continue;
+		}
+
+		while ((node != root) && (node->sibling == NULL)) {
+			node = node->parent;
+		}
+
+		node = (node != root) ? node->sibling : NULL;
+	}
+
+	return 0;
+}
+
+int
+psca_set_trace(psca_t p,
+               int    fd)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	int ret = 0;
+
+	if (pool->trace != NULL) {
+		ret = psca_trace_flush(pool->trace);
+
+		free(pool->trace);
+		pool->trace = NULL;
+	}
+
+	if (fd < 0) {
+		return ret;
+	}
+
+	pool->trace = malloc(sizeof(psca_trace_t));
+
+	if (pool->trace == NULL) {
+		return -1;
+	}
+
+	pool->trace->fd = fd;
+	pool->trace->len = sizeof(PSCA_TRACE_MAGIC) - 1;
+
+	memcpy(pool->trace->buf, PSCA_TRACE_MAGIC, pool->trace->len);
+
+	/* frames already on the stack are pushed first on replay */
+	psca_trace_num(pool->trace,
+	               (pool->frames != NULL) ? pool->frames->depth + 1 : 0);
+
+	return ret;
+}
+
+void
+psca_get_name(psca_t  p,
+              char   *name)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	memcpy(name, pool->name, PSCA_NAME_MAX);
+}
+
+void
+psca_set_name(psca_t      p,
+              const char *name)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	/* unnamed pools go by their address, worked out once here so block
+	 * requests can hand the name to the provider as it is */
+	if (name == NULL) {
+		snprintf(pool->name, PSCA_NAME_MAX, "%lx", (unsigned long)(uintptr_t)pool);
+		return;
+	}
+
+	strncpy(pool->name, name, PSCA_NAME_MAX - 1);
+	pool->name[PSCA_NAME_MAX - 1] = '\0';
+}
+
+int
+psca_set_export(psca_t p,
+                int    value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_export_page_t *page;
+	char name[PSCA_NAME_MAX];
+	char path[PSCA_NAME_MAX + 32];
+	int fd;
+
+	/* the page keeps the name it was created with */
+	if (pool->export != NULL) {
+		page = pool->export;
+
+		snprintf(path, sizeof(path), "/psca.%ld.%s", page->info.pid,
+		         page->info.name);
+		shm_unlink(path);
+		munmap(page, sizeof(psca_export_page_t));
+
+		pool->export = NULL;
+	}
+
+	if (!value) {
+		return 0;
+	}
+
+	psca_get_name(pool, name);
+	snprintf(path, sizeof(path), "/psca.%ld.%s", (long)getpid(), name);
+
+	fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(psca_export_page_t)) == -1) {
+		goto fail;
+	}
+
+	page = mmap(NULL, sizeof(psca_export_page_t), PROT_READ | PROT_WRITE,
+	            MAP_SHARED, fd, 0);
+
+	if (page == MAP_FAILED) {
+		goto fail;
+	}
+
+	close(fd);
+
+	page->info.pid = (long)getpid();
+	memcpy(page->info.name, name, PSCA_NAME_MAX);
+
+	/* readers check the magic last, once the page is set up */
+	__atomic_store_n(&page->magic, PSCA_EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+	pool->export = page;
+	psca_export_update(pool);
+
+	return 0;
+
+fail:
+	close(fd);
+	shm_unlink(path);
+
+	return -1;
+}
+
+int
+psca_read_export(const char    *path,
+                 psca_export_t *info)
+{
+	psca_export_page_t *page;
+	int fd = shm_open(path, O_RDONLY, 0);
+	int ret = -1;
+	int i;
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	page = mmap(NULL, sizeof(psca_export_page_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (page == MAP_FAILED) {
+		return -1;
+	}
+
+	if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != PSCA_EXPORT_MAGIC) {
+		goto out;
+	}
+
+	for (i = 0; i < PSCA_EXPORT_RETRIES; i++) {
+		unsigned seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		memcpy(info, &page->info, sizeof(psca_export_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+			ret = 0;
+			break;
+		}
+	}
+
+out:
+	munmap(page, sizeof(psca_export_page_t));
+
+	return ret;
+}
+
+void
+psca_set_reclaimer(psca_t           p,
+                   psca_reclaimer_t r)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->reclaimer = PSCA_RECLAIMER_P(r);
+}
+
+psca_t
+psca_new(void)
+{
+	psca_pool_t *pool = malloc(sizeof(psca_pool_t));
+	memset(pool, 0, sizeof(psca_pool_t));
+
+	pool->alloc_func = psca_default_alloc;
+	pool->free_func = psca_default_free;
+	pool->block_size = PSCA_POOL_DEFAULT_BLOCK_SIZE;
+	pool->growth_factor = PSCA_POOL_DEFAULT_GROWTH_FACTOR;
+	pool->block_growth = PSCA_POOL_DEFAULT_BLOCK_GROWTH;
+	pool->max_block_size = PSCA_POOL_DEFAULT_MAX_BLOCK;
+	pool->redzone = PSCA_POOL_DEFAULT_REDZONE;
+	pool->sample_left = SIZE_MAX;
+
+	psca_set_name(pool, NULL);
+
+	return pool;
+}
+
+int
+psca_destroy(psca_t p)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+	psca_frame_chunk_t *chunk = pool->chunk;
+	size_t i;
+
+	psca_drain(p);
+
+	/* the reclaimer may still be refilling the spares */
+	psca_set_prefault(p, 0);
+
+	/* the current chunk may be anywhere in the list */
+	while ((chunk != NULL) && (chunk->prev != NULL)) {
+		chunk = chunk->prev;
+	}
+
+	while (chunk != NULL) {
+		psca_frame_chunk_t *next = chunk->next;
+
+		free(chunk);
+
+		chunk = next;
+	}
+
+	free(pool->batch);
+	for (i = 0; i < pool->prof_cap; i++) {
+		psca_prof_stack_t *stack = pool->prof_stacks[i];
+
+		while (stack != NULL) {
+			psca_prof_stack_t *next = stack->next;
+
+			free(stack);
+
+			stack = next;
+		}
+	}
+
+	free(pool->prof_stacks);
+	free(pool->prof_live);
+
+	psca_flame_free(&pool->flame_root);
+
+	psca_set_trace(p, -1);
+	psca_set_export(p, 0);
+
+#ifdef PSCA_WITH_VALGRIND
+	free(pool->vg_merged);
+#endif
+	free((void *)p);
+
+	return 0;
+}
+
+void
+psca_set_funcs(psca_t             p,
+               psca_alloc_func_t  alloc_func,
+               psca_free_func_t   free_func,
+               void              *context)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->alloc_func = alloc_func;
+	pool->free_func = free_func;
+	pool->context = context;
+}
+
+void
+psca_set_alloc_hint_func(psca_t                 p,
+                         psca_alloc_hint_func_t alloc_hint_func)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->alloc_hint_func = alloc_hint_func;
+}
+
+void
+psca_set_free_batch_func(psca_t                 p,
+                         psca_free_batch_func_t free_batch_func)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->free_batch_func = free_batch_func;
+}
+
+void
+psca_set_block_size(psca_t p,
+                    size_t value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->block_size = value;
+}
+
+void
+psca_set_growth_factor(psca_t p,
+                       int    value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->growth_factor = value;
+}
+
+void
+psca_set_deferred_free(psca_t p,
+                       int    value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->defer_free = value;
+}
+
+void
+psca_set_release_limit(psca_t p,
+                       size_t value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->release_limit = value;
+}
+
+void
+psca_set_block_growth(psca_t p,
+                      int    value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->block_growth = value;
+}
+
+void
+psca_set_max_block_size(psca_t p,
+                        size_t value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->max_block_size = value;
+}
+
+void
+psca_set_adaptive_limit(psca_t p,
+                        size_t value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->adaptive_limit = value;
+}
+
+void
+psca_set_redzone(psca_t p,
+                 size_t value)
+{
+	psca_pool_t *pool = PSCA_POOL_P(p);
+
+	pool->redzone = value;
 }
 
 int
@@ -111,6 +111,103 @@ typedef void * (* psca_alloc_func_t)(size_t *size, void *context);
  */
 typedef void (* psca_free_func_t)(void *block, void *context);
 
+/**
+ * @brief A block handed to a batch deallocation function.
+ */
+typedef struct {
+	void   *block;  /**< The block, as returned by psca_alloc_func_t.     */
+	size_t  size;   /**< Its size, as reported by psca_alloc_func_t.      */
+} psca_block_info_t;
+
+/**
+ * @brief Batch memory deallocation function pointer.
+ *
+ * This prototype describes an optional callback used by the pool to
+ * deallocate all the blocks released by a single operation (popping one
+ * or more frames, or psca_drain()) at once, instead of calling the
+ * psca_free_func_t for each of them. This lets a provider coalesce
+ * adjacent blocks and give them back with fewer system calls.
+ *
+ * @param[in]  blocks   The blocks to free. The function may reorder the
+ *                      array as it sees fit.
+ *
+ * @param[in]  count    Number of blocks in `blocks`.
+ *
+ * @param[in]  context  User data set by psca_set_funcs().
+ *
+ * @see psca_set_free_batch_func()
+ */
+typedef void (* psca_free_batch_func_t)(psca_block_info_t *blocks,
+                                        size_t count, void *context);
+
+/**
+ * @brief What a block requested from the provider is going to be used for.
+ */
+typedef enum {
+	PSCA_BLOCK_FIRST,   /**< First block of a frame.                        */
+	PSCA_BLOCK_GROWTH,  /**< Further block for a frame that ran out of room. */
+	PSCA_BLOCK_LARGE,   /**< Block for one allocation larger than the block
+	                         size.                                          */
+	PSCA_BLOCK_RESERVE, /**< Block sized by psca_reserve() or
+	                         psca_begin_write().                            */
+	PSCA_BLOCK_SIDE,    /**< Block for psca_malloc_in() into a frame below
+	                         the top of the stack.                          */
+	PSCA_BLOCK_SPARE    /**< Block kept ready ahead of time, see
+	                         psca_set_prefault().                           */
+} psca_block_purpose_t;
+
+/**
+ * @brief How long a block requested from the provider is expected to live.
+ */
+typedef enum {
+	PSCA_LIFETIME_SHORT, /**< Released when a nested frame is popped.      */
+	PSCA_LIFETIME_LONG   /**< Owned by the bottom frame, or by a frame with
+	                          other frames pushed on top of it.            */
+} psca_lifetime_t;
+
+/**
+ * @brief Hints passed along with a block request.
+ */
+typedef struct {
+	psca_block_purpose_t purpose;   /**< What the block is for.             */
+	unsigned             depth;     /**< Depth of the frame that will own
+	                                     the block, 0 being the bottom.
+	                                     Always 0 for spare blocks.         */
+	size_t               alignment; /**< Alignment the block must have, 0
+	                                     when the pool needs no more than
+	                                     malloc() gives.                    */
+	psca_lifetime_t      lifetime;  /**< How long the block should live.    */
+	const char          *name;      /**< Name of the pool, as returned by
+	                                     psca_get_name().                   */
+} psca_alloc_hint_t;
+
+/**
+ * @brief Memory allocation function pointer, with hints.
+ *
+ * This prototype describes an optional replacement for psca_alloc_func_t
+ * that also receives a description of the block being requested, so a
+ * provider can place, size and cache blocks according to how they are
+ * going to be used. Blocks it returns are released with the
+ * psca_free_func_t (or psca_free_batch_func_t) as usual.
+ *
+ * @param[in,out]  size     Number of bytes to allocate. On return, the
+ *                          function should set the actual number of bytes
+ *                          allocated that are usable by the caller.
+ *
+ * @param[in]      hint     Description of the block. Only valid for the
+ *                          duration of the call.
+ *
+ * @param[in]      context  User data set by psca_set_funcs().
+ *
+ * @return                  Pointer to newly allocated block of memory, or
+ *                          NULL on error.
+ *
+ * @see psca_set_alloc_hint_func()
+ */
+typedef void * (* psca_alloc_hint_func_t)(size_t *size,
+                                          const psca_alloc_hint_t *hint,
+                                          void *context);
+
 /**
  * @brief Handle for a psca pool.
  *
@@ -119,6 +216,23 @@ typedef void (* psca_free_func_t)(void *block, void *context);
  */
 typedef const void * psca_t;
 
+/**
+ * @brief Counters kept by a pool.
+ *
+ * @see psca_get_stats()
+ */
+typedef struct {
+	size_t block_allocs;    /**< Blocks requested from the provider.      */
+	size_t prefaulted;      /**< Spare blocks prefaulted.                 */
+	size_t prefault_hits;   /**< New blocks served by a spare block.      */
+	size_t prefault_misses; /**< New blocks that could have been served by
+	                             a spare block, but none was ready.       */
+	size_t block_frees;     /**< Blocks handed back to the provider, or to
+	                             a reclaimer.                             */
+	size_t block_bytes;     /**< Bytes held in blocks, as reported by the
+	                             provider.                                */
+} psca_stats_t;
+
 /**
  * @brief Initialize a new pool.
  *
@@ -144,6 +258,12 @@ int psca_destroy(psca_t pool);
 /**
  * @brief Set allocation/deallocation functions for a pool.
  *
+ * The functions provide the blocks that allocations are served from. The
+ * pool's own records, such as those of the frames on its stack, come from
+ * malloc() instead: they are kept until the pool is destroyed, so drawing
+ * them from a provider that hands blocks back in stack order would keep
+ * every block acquired before them from ever being given back.
+ *
  * @param[in]  pool       The pool to set the functions for.
  *
  * @param[in]  alloc_func The allocation function to use.
@@ -162,6 +282,245 @@ int psca_destroy(psca_t pool);
 void psca_set_funcs(psca_t pool, psca_alloc_func_t alloc_func,
                     psca_free_func_t free_func, void *context);
 
+/**
+ * @brief Set the batch deallocation function for a pool.
+ *
+ * The function receives the same context as the functions set by
+ * psca_set_funcs(). The psca_free_func_t is still used if the pool fails
+ * to gather a batch.
+ *
+ * @param[in]  pool            The pool to set the function for.
+ *
+ * @param[in]  free_batch_func The batch deallocation function, or NULL
+ *                             (the default) to free blocks one by one.
+ *
+ * @see psca_free_batch_func_t
+ */
+void psca_set_free_batch_func(psca_t pool,
+                              psca_free_batch_func_t free_batch_func);
+
+/**
+ * @brief Set the hinted allocation function for a pool.
+ *
+ * When set, the function is used instead of the psca_alloc_func_t set by
+ * psca_set_funcs(), and receives the same context.
+ *
+ * @param[in]  pool            The pool to set the function for.
+ *
+ * @param[in]  alloc_hint_func The allocation function, or NULL (the
+ *                             default) to use the psca_alloc_func_t.
+ *
+ * @warning                    The same restrictions as for
+ *                             psca_set_funcs() apply.
+ *
+ * @see psca_alloc_hint_func_t
+ */
+void psca_set_alloc_hint_func(psca_t pool,
+                              psca_alloc_hint_func_t alloc_hint_func);
+
+/**
+ * @brief Number of buckets in a histogram.
+ */
+#define PSCA_HIST_BUCKETS (32)
+
+/**
+ * @brief Operations timed by a pool.
+ *
+ * @see psca_get_histogram()
+ */
+enum {
+	PSCA_HIST_PUSH, /**< psca_push() and psca_push_label().                 */
+	PSCA_HIST_POP,  /**< psca_pop() and psca_pop_to(), releases included.   */
+	PSCA_HIST_GROW, /**< Allocations that needed a new block.               */
+	PSCA_HIST_COUNT
+};
+
+/**
+ * @brief Latency histogram of an operation.
+ *
+ * Bucket `i` counts the operations that took from 2^i to 2^(i+1) - 1
+ * nanoseconds, bucket 0 also counting those that took no measurable time.
+ * The last bucket counts everything slower.
+ */
+typedef struct {
+	size_t count;                       /**< Operations timed.             */
+	size_t total_ns;                    /**< Time spent in all of them.    */
+	size_t max_ns;                      /**< Slowest one.                  */
+	size_t buckets[PSCA_HIST_BUCKETS];  /**< Operations per duration.      */
+} psca_histogram_t;
+
+/**
+ * @brief Enable or disable timing of operations for a pool.
+ *
+ * Pushes, pops and allocations that need a new block are timed with
+ * clock_gettime() and recorded in per-pool histograms. When disabled (the
+ * default), this costs a single branch per operation.
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  value    Non-zero to enable timing. Enabling it clears the
+ *                      histograms.
+ *
+ * @see psca_get_histogram()
+ */
+void psca_set_timing(psca_t pool, int value);
+
+/**
+ * @brief Get the latency histogram of an operation.
+ *
+ * @param[in]   pool    The pool.
+ *
+ * @param[in]   op      One of PSCA_HIST_PUSH, PSCA_HIST_POP and
+ *                      PSCA_HIST_GROW.
+ *
+ * @param[out]  hist    Where to store the histogram.
+ *
+ * @return              Returns 0 on success and -1 if `op` is invalid.
+ *
+ * @see psca_set_timing()
+ */
+int psca_get_histogram(psca_t pool, int op, psca_histogram_t *hist);
+
+/**
+ * @brief Enable or disable allocation sampling for a pool.
+ *
+ * With sampling, the pool records the call stack of one allocation every
+ * `interval` bytes allocated on average, along with its size. The gaps
+ * between samples are exponentially distributed, as pprof expects.
+ * Samples are accounted as in use until the frame they were taken in is
+ * popped, or its parent if it was merged. Only psca_malloc(),
+ * psca_malloc_in() and psca_malloc_wrapped() are sampled. When disabled
+ * (the default), the cost is one comparison per allocation.
+ *
+ * @param[in]  pool      The pool.
+ *
+ * @param[in]  interval  Average number of bytes between samples, or 0 to
+ *                       stop sampling. Samples taken so far are kept.
+ *
+ * @see psca_write_profile()
+ */
+void psca_set_sampling(psca_t pool, size_t interval);
+
+/**
+ * @brief Allocate memory from a function wrapping the allocator.
+ *
+ * This is psca_malloc(), for functions that only wrap it. The wrapper is
+ * left out of the call stacks of samples, so they point at its callers
+ * instead. psca_malloc_tagged() allocates with it.
+ *
+ * @param[in]  pool     The pool to allocate from.
+ *
+ * @param[in]  size     Number of bytes to allocate.
+ *
+ * @return              Allocated memory, NULL on error.
+ *
+ * @see psca_set_sampling()
+ */
+void *psca_malloc_wrapped(psca_t pool, size_t size);
+
+/**
+ * @brief Write the samples of a pool as a heap profile.
+ *
+ * The profile is in the legacy text format read by pprof (heap_v2), so it
+ * can be inspected with `pprof <program> <profile>`.
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  fd       The descriptor to write to.
+ *
+ * @return              Returns 0 on success and -1 on error.
+ *
+ * @see psca_set_sampling()
+ */
+int psca_write_profile(psca_t pool, int fd);
+
+/**
+ * @brief Values that can be written by psca_write_flamegraph().
+ */
+enum {
+	PSCA_FLAME_TOTAL, /**< Bytes allocated in all the frames of a path.   */
+	PSCA_FLAME_PEAK   /**< Most bytes a frame of a path had at once.      */
+};
+
+/**
+ * @brief Enable or disable label path accounting for a pool.
+ *
+ * The pool keeps track of how many bytes are allocated under each path
+ * of labels passed to psca_push_label(), from the bottom of the stack to
+ * the top. Unlabeled frames are accounted to their parent's path. Frames
+ * that were pushed while accounting was disabled are not accounted.
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  value    Non-zero to enable accounting, 0 (the default) to
+ *                      disable it. What was accounted so far is kept.
+ *
+ * @see psca_write_flamegraph()
+ */
+void psca_set_flamegraph(psca_t pool, int value);
+
+/**
+ * @brief Write the label paths of a pool in folded stack format.
+ *
+ * Every line holds a path of labels separated by semicolons, and a number
+ * of bytes, which flamegraph.pl and speedscope turn into a flamegraph.
+ * Those tools add up the values of nested paths, so every line only holds
+ * the bytes its nested paths do not account for.
+ *
+ * With PSCA_FLAME_TOTAL, the width of a path in the flamegraph is the
+ * number of bytes allocated under it. With PSCA_FLAME_PEAK, it is at
+ * least the largest number of bytes that a single frame on the path and
+ * the frames nested in it had allocated at once. It can be more, since
+ * nested frames that never coexisted are added up.
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  fd       The descriptor to write to.
+ *
+ * @param[in]  what     PSCA_FLAME_TOTAL or PSCA_FLAME_PEAK.
+ *
+ * @return              Returns 0 on success and -1 if `what` is invalid.
+ *
+ * @see psca_set_flamegraph()
+ */
+int psca_write_flamegraph(psca_t pool, int fd, int what);
+
+/**
+ * @brief Keep prefaulted blocks ready for a pool.
+ *
+ * The pool keeps up to `count` spare blocks of the pool's block size whose
+ * pages have all been touched, so the kernel has already backed them.
+ * When a frame needs a new block no larger than that, it gets one of the
+ * spares instead of memory that faults on first use.
+ *
+ * Spares are refilled on the pool's reclaimer (see psca_set_reclaimer()),
+ * never on the pool's own thread, so the pool needs a reclaimer before
+ * spares are asked for. Spares are no longer refilled once the reclaimer
+ * is removed. Since spares are allocated from the provider on the
+ * reclaimer's thread, the provider must be thread-safe.
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  count    Number of spare blocks to keep, from 0 (the
+ *                      default) to 4. The first spares are allocated
+ *                      right away, on the calling thread.
+ *
+ * @return              Returns 0 on success and -1 if `count` is out of
+ *                      range, or not 0 and the pool has no reclaimer.
+ */
+int psca_set_prefault(psca_t pool, int count);
+
+/**
+ * @brief Get the counters of a pool.
+ *
+ * @param[in]   pool    The pool.
+ *
+ * @param[out]  stats   Where to store the counters.
+ *
+ * @return              Returns 0 on success and -1 on error.
+ */
+int psca_get_stats(psca_t pool, psca_stats_t *stats);
+
 /**
  * @brief Set block size for a pool.
  *
@@ -189,6 +548,111 @@ void psca_set_block_size(psca_t pool, size_t value);
  */
 void psca_set_growth_factor(psca_t pool, int value);
 
+/**
+ * @brief Enable or disable deferred frees for a pool.
+ *
+ * With deferred frees, blocks released by popping frames are not given
+ * back to the deallocation function right away. They are set aside until
+ * psca_drain() is called (or the pool is destroyed), so that popping
+ * frames on a latency sensitive path never calls into the provider.
+ *
+ * @param[in]  pool     The pool to set deferred frees for.
+ *
+ * @param[in]  value    Non-zero to defer frees, 0 (the default) to free
+ *                      blocks as frames are popped. Blocks that are already
+ *                      set aside stay so until psca_drain() is called.
+ *
+ * @see psca_drain()
+ */
+void psca_set_deferred_free(psca_t pool, int value);
+
+/**
+ * @brief Limit the number of blocks released by a single operation.
+ *
+ * With a release limit, popping a frame gives at most `value` blocks back
+ * to the deallocation function. The rest are set aside, and each later
+ * push, pop, or allocation that needs a new block releases up to `value`
+ * more of them, so no operation does more than a bounded amount of work.
+ * psca_drain() releases everything that is left at once.
+ *
+ * Deferred frees take precedence: while they are enabled, nothing set
+ * aside is released until psca_drain() is called. Releases handed to a
+ * reclaimer are not limited either, since they cost the caller nothing.
+ *
+ * @param[in]  pool     The pool to set the limit for.
+ *
+ * @param[in]  value    Number of blocks, or 0 (the default) for no limit.
+ *
+ * @see psca_drain()
+ */
+void psca_set_release_limit(psca_t pool, size_t value);
+
+/**
+ * @brief Set the block growth for a pool.
+ *
+ * The block growth is used when a frame runs out of room and needs another
+ * block. Each block a frame adds is `value` times larger than the last
+ * block it added, up to the maximum block size, so a frame that ends up
+ * very large only owns a handful of blocks. Allocations larger than the
+ * block size are still governed by the growth factor.
+ *
+ * @param[in]  pool     The pool to set the block growth for.
+ *
+ * @param[in]  value    The multiplier, 1 (no growth) by default.
+ *
+ * @see psca_set_max_block_size()
+ */
+void psca_set_block_growth(psca_t pool, int value);
+
+/**
+ * @brief Set the maximum block size for a pool.
+ *
+ * This caps the size that block growth can reach. It does not limit blocks
+ * for allocations larger than the cap.
+ *
+ * @param[in]  pool     The pool to set the maximum block size for.
+ *
+ * @param[in]  value    The size (in bytes), 64 MB by default.
+ *
+ * @see psca_set_block_growth()
+ */
+void psca_set_max_block_size(psca_t pool, size_t value);
+
+/**
+ * @brief Set the adaptive block size limit for a pool.
+ *
+ * With adaptive block sizing, the pool remembers how much memory frames
+ * used when they were popped, keyed by the label given to
+ * psca_push_label(), or by their depth for unlabeled frames. The next frame
+ * pushed with the same label (or at the same depth) gets a first block
+ * sized to fit that usage, instead of one of the default block size, so
+ * small frames do not waste memory and large frames do not have to grow
+ * one block at a time.
+ *
+ * @param[in]  pool     The pool to set the limit for.
+ *
+ * @param[in]  value    The largest first block (in bytes) the pool will
+ *                      pick for a frame, or 0 to disable adaptive block
+ *                      sizing. It is disabled by default.
+ *
+ * @see psca_push_label()
+ */
+void psca_set_adaptive_limit(psca_t pool, size_t value);
+
+/**
+ * @brief Set the redzone size for a pool.
+ *
+ * When the library is built with poisoning (PSCA_WITH_POISONING or
+ * PSCA_WITH_VALGRIND), every allocation is followed by this many poisoned
+ * bytes, so that overflows into the next allocation are caught by
+ * AddressSanitizer or memcheck. Otherwise the redzone is ignored.
+ *
+ * @param[in]  pool     The pool to set the redzone size for.
+ *
+ * @param[in]  value    The size (in bytes) of the redzone, 16 by default.
+ */
+void psca_set_redzone(psca_t pool, size_t value);
+
 /**
  * @brief Push a new frame onto the pool allocation stack.
  *
@@ -207,6 +671,26 @@ void psca_set_growth_factor(psca_t pool, int value);
  */
 const void *psca_push(psca_t pool);
 
+/**
+ * @brief Push a new labeled frame onto the pool allocation stack.
+ *
+ * This behaves like psca_push(), except that the frame is identified by a
+ * label instead of its depth when the pool keeps track of frame usage.
+ *
+ * @param[in]  pool     The pool to push the frame onto.
+ *
+ * @param[in]  label    A string with static storage duration, such as a
+ *                      string literal. Labels are compared by address, and
+ *                      must stay valid for the lifetime of the pool. May
+ *                      be NULL, which is the same as calling psca_push().
+ *
+ * @return              Pointer to newly pushed frame.
+ *
+ * @see psca_push()
+ * @see psca_set_adaptive_limit()
+ */
+const void *psca_push_label(psca_t pool, const char *label);
+
 /**
  * @brief Pop a frame from the pool allocation stack.
  *
@@ -223,6 +707,86 @@ const void *psca_push(psca_t pool);
  */
 const void *psca_pop(psca_t pool);
 
+/**
+ * @brief Pop frames until a given frame has been popped.
+ *
+ * Unwinds the stack down to and including `frame`, as if psca_pop() had
+ * been called for it and every frame above it, which is useful on error
+ * paths that leave several scopes at once. The blocks of all the popped
+ * frames are released together in a single pass.
+ *
+ * @param[in]  pool     The pool to pop frames from.
+ *
+ * @param[in]  frame    The last frame to pop, as returned by psca_push().
+ *
+ * @return              `frame`, or NULL if it is not on the stack, in
+ *                      which case nothing is popped.
+ *
+ * @see psca_pop()
+ */
+const void *psca_pop_to(psca_t pool, const void *frame);
+
+/**
+ * @brief Release blocks set aside by deferred frees.
+ *
+ * This also releases the blocks left over by a release limit right away.
+ *
+ * @param[in]  pool     The pool to release blocks of.
+ *
+ * @return              Number of blocks released.
+ *
+ * @see psca_set_deferred_free()
+ * @see psca_set_release_limit()
+ */
+size_t psca_drain(psca_t pool);
+
+/**
+ * @brief Pop a frame, keeping copies of some of its allocations.
+ *
+ * The top-most frame is popped and the listed allocations are copied,
+ * one after the other, into a single allocation in the parent frame.
+ * This is meant for keeping a few small results of a frame that used a
+ * lot of temporary memory.
+ *
+ * @param[in]      pool     The pool to pop a frame from.
+ *
+ * @param[in,out]  ptrs     The allocations to keep. On return, they are
+ *                          replaced with the addresses of the copies, or
+ *                          NULL if the parent frame could not make room
+ *                          for them (the frame is popped regardless), or
+ *                          if all the sizes are 0.
+ *
+ * @param[in]      sizes    Size of each allocation in `ptrs`.
+ *
+ * @param[in]      n        Number of allocations to keep.
+ *
+ * @return                  Pointer to the popped frame, as with
+ *                          psca_pop(), or NULL on error, in which case
+ *                          the frame is still on the stack.
+ *
+ * @see psca_pop()
+ * @see psca_merge()
+ */
+const void *psca_pop_retain(psca_t pool, void **ptrs, size_t *sizes,
+                            size_t n);
+
+/**
+ * @brief Pop a frame, keeping its allocations in its parent.
+ *
+ * The top-most frame is removed from the stack, but nothing it allocated
+ * is released. Its blocks and allocations are handed over to the parent
+ * frame as they are, and are released when the parent is popped. This
+ * takes constant time and copies nothing.
+ *
+ * @param[in]  pool     The pool to merge the top-most frame in.
+ *
+ * @return              Pointer to the merged frame, as with psca_pop(),
+ *                      or NULL if the frame has no parent.
+ *
+ * @see psca_pop()
+ */
+const void *psca_merge(psca_t pool);
+
 /**
  * @brief Allocate memory from the pool allocation stack.
  *
@@ -234,6 +798,774 @@ const void *psca_pop(psca_t pool);
  */
 void *psca_malloc(psca_t pool, size_t size);
 
+/**
+ * @brief Allocate memory in a frame below the top of the stack.
+ *
+ * The allocation has the lifetime of the given frame instead of the
+ * top-most one, so results computed in nested frames can outlive them
+ * without being copied out at every level. Such allocations are served
+ * from separate blocks owned by the frame, which are released when it is
+ * popped, along with its other blocks in the order they were acquired.
+ *
+ * Side blocks still outlive the blocks of the frames above that were
+ * acquired before them. A provider that can only take blocks back in
+ * stack order, such as psca_shm_free(), keeps those blocks reserved.
+ *
+ * @param[in]  pool     The pool to allocate from.
+ *
+ * @param[in]  frame    A frame on the pool's stack, as returned by
+ *                      psca_push().
+ *
+ * @param[in]  size     Number of bytes to allocate.
+ *
+ * @return              Allocated memory, NULL on error.
+ */
+void *psca_malloc_in(psca_t pool, const void *frame, size_t size);
+
+/**
+ * @brief Reserve contiguous room in the top-most frame.
+ *
+ * Makes sure the top-most frame can satisfy allocations totalling `size`
+ * bytes without going back to the block provider. If the frame does not
+ * have that much room left, a single block of (at least) `size` bytes is
+ * added to it. When the library is built with poisoning, the redzone
+ * following each allocation counts towards the reserved room.
+ *
+ * @param[in]  pool     The pool to reserve room in.
+ *
+ * @param[in]  size     Number of bytes to reserve.
+ *
+ * @return              Returns 0 on success and -1 on error.
+ */
+int psca_reserve(psca_t pool, size_t size);
+
+/**
+ * @brief Start writing data of unknown length to the top-most frame.
+ *
+ * Returns room for up to `size` contiguous bytes at the top of the
+ * top-most frame, without allocating it. Once the data is written,
+ * psca_commit() allocates the part that was used, and the rest stays
+ * available to the frame without any copying.
+ *
+ * @code
+ *     char *buf = psca_begin_write(pool, 4096);
+ *     int len = snprintf(buf, 4096, "%s: %d", name, value);
+ *     psca_commit(pool, len + 1);
+ * @endcode
+ *
+ * No other allocation may be made from the pool between psca_begin_write()
+ * and psca_commit().
+ *
+ * @param[in]  pool     The pool to write to.
+ *
+ * @param[in]  size     Largest number of bytes that will be written.
+ *
+ * @return              Start of the room to write to, NULL on error.
+ *
+ * @see psca_commit()
+ */
+void *psca_begin_write(psca_t pool, size_t size);
+
+/**
+ * @brief Allocate the data written since psca_begin_write().
+ *
+ * @param[in]  pool     The pool that was written to.
+ *
+ * @param[in]  size     Number of bytes to keep, at most the size given to
+ *                      psca_begin_write(); larger sizes are cut down to
+ *                      it. 0 abandons the write and leaves the frame as it
+ *                      was.
+ *
+ * @return              Start of the committed data, the same pointer that
+ *                      psca_begin_write() returned.
+ *
+ * @see psca_begin_write()
+ */
+void *psca_commit(psca_t pool, size_t size);
+
+/** @} **********************************************************************/
+
+/**
+ * @defgroup psca_shm Shared-memory segments
+ *
+ * A shared-memory segment is a memfd (or POSIX shared memory object on
+ * systems without memfd) that is mapped at the same address in every
+ * process using it. A pool that draws its blocks from a segment builds
+ * frames whose pointers stay valid in every process that maps the
+ * segment, so read-mostly data built by one process can be used by the
+ * others without copying or serializing it.
+ *
+ * Only one process may build frames in a segment. Other processes either
+ * inherit the mapping across fork() or attach to it read-only with
+ * psca_shm_attach().
+ *
+ * @code
+ *     psca_shm_t shm = psca_shm_create("dataset", 256 << 20, NULL);
+ *     psca_t pool = psca_new();
+ *
+ *     psca_set_shm(pool, shm);
+ *     psca_push(pool);
+ *     psca_shm_set_root(shm, build_dataset(pool));
+ *
+ *     ... fork workers, each calling psca_shm_root(shm) ...
+ * @endcode
+ *
+ * @{
+ */
+
+/**
+ * @brief Handle for a shared-memory segment.
+ */
+typedef const void * psca_shm_t;
+
+/**
+ * @brief Create a new shared-memory segment.
+ *
+ * @param[in]  name     Name of the segment, only used for debugging
+ *                      (it shows up in /proc/<pid>/maps). May be NULL.
+ *
+ * @param[in]  size     Size of the segment in bytes. It is rounded up to
+ *                      the page size and cannot grow afterwards.
+ *
+ * @param[in]  addr     Address to map the segment at, or NULL to let the
+ *                      system pick one. Processes that do not inherit the
+ *                      mapping must be able to map it at the same address,
+ *                      so pick one that is unlikely to be used otherwise.
+ *
+ * @return              New segment or NULL on error.
+ *
+ * @see psca_shm_destroy()
+ */
+psca_shm_t psca_shm_create(const char *name, size_t size, void *addr);
+
+/**
+ * @brief Attach to an existing shared-memory segment.
+ *
+ * The segment is mapped read-only at the address it was created at. Pools
+ * can not allocate from an attached segment.
+ *
+ * @param[in]  fd       Descriptor of the segment, as returned by
+ *                      psca_shm_fd() in the creating process and passed
+ *                      over a unix socket or opened via /proc/<pid>/fd.
+ *
+ * @return              Attached segment or NULL on error, including when
+ *                      the address the segment lives at is already in
+ *                      use in this process.
+ */
+psca_shm_t psca_shm_attach(int fd);
+
+/**
+ * @brief Unmap a shared-memory segment and release the handle.
+ *
+ * Any pool using the segment must be destroyed first.
+ *
+ * @param[in]  shm      The segment to destroy.
+ *
+ * @return              Returns 0 on success and -1 on error.
+ */
+int psca_shm_destroy(psca_shm_t shm);
+
+/**
+ * @brief Get the file descriptor backing a segment.
+ *
+ * @param[in]  shm      The segment.
+ *
+ * @return              The descriptor, owned by the segment.
+ */
+int psca_shm_fd(psca_shm_t shm);
+
+/**
+ * @brief Get the address a segment is mapped at.
+ *
+ * @param[in]  shm      The segment.
+ *
+ * @return              Start of the mapping.
+ */
+void *psca_shm_base(psca_shm_t shm);
+
+/**
+ * @brief Publish the entry point of the data built in a segment.
+ *
+ * @param[in]  shm      The segment, which must have been created (not
+ *                      attached) by this process.
+ *
+ * @param[in]  root     Pointer into the segment for readers to start from.
+ *
+ * @return              Returns 0 on success and -1 on error.
+ */
+int psca_shm_set_root(psca_shm_t shm, const void *root);
+
+/**
+ * @brief Get the entry point published with psca_shm_set_root().
+ *
+ * @param[in]  shm      The segment.
+ *
+ * @return              The published pointer, or NULL if there is none yet.
+ */
+void *psca_shm_root(psca_shm_t shm);
+
+/**
+ * @brief Block allocation function drawing from a segment.
+ *
+ * Matches psca_alloc_func_t, with the segment as the context.
+ */
+void *psca_shm_alloc(size_t *size, void *context);
+
+/**
+ * @brief Block deallocation function returning blocks to a segment.
+ *
+ * Matches psca_free_func_t, with the segment as the context. Blocks are
+ * handed back in stack order as frames are popped; a block released out
+ * of order stays reserved until the segment is destroyed. This is safe to
+ * call from another thread than the one acquiring blocks, but a pool
+ * releasing its blocks on a reclaimer (see psca_set_reclaimer()) can hand
+ * them back after newer blocks were acquired, which leaves them reserved.
+ */
+void psca_shm_free(void *block, void *context);
+
+/**
+ * @brief Make a pool allocate its blocks from a segment.
+ *
+ * This is a shorthand for calling psca_set_funcs() with psca_shm_alloc()
+ * and psca_shm_free().
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  shm      The segment, created by this process.
+ */
+void psca_set_shm(psca_t pool, psca_shm_t shm);
+
+/** @} **********************************************************************/
+
+/**
+ * @defgroup psca_mmap Anonymous mapping provider
+ *
+ * A block provider that maps every block directly from the kernel and
+ * keeps a small per-node cache of released blocks. On hosts with more than
+ * one memory node, blocks can be placed on the node of the thread that
+ * acquires them. On single-node hosts the NUMA options are accepted and
+ * simply have nothing to do.
+ *
+ * Blocks acquired through psca_mmap_alloc_hint() are named after the pool
+ * they are for, and show up as `[anon:psca:<pool name>]` in
+ * /proc/<pid>/maps and smaps on kernels built with CONFIG_ANON_VMA_NAME
+ * (Linux 5.17 and later). Elsewhere they stay anonymous.
+ *
+ * A provider can be shared by any number of pools and threads.
+ *
+ * @{
+ */
+
+/**
+ * @brief Maximum number of memory nodes tracked by a provider.
+ *
+ * Nodes past this limit are accounted as node 0.
+ */
+#define PSCA_MMAP_MAX_NODES (64)
+
+/**
+ * @brief Bind new blocks to the node of the calling thread with mbind().
+ */
+#define PSCA_MMAP_NUMA_BIND     (1 << 0)
+
+/**
+ * @brief Touch every page of a new block from the calling thread, so the
+ *        first-touch policy places it on that thread's node.
+ */
+#define PSCA_MMAP_NUMA_PREFAULT (1 << 1)
+
+/**
+ * @brief Handle for a mapping provider.
+ */
+typedef const void * psca_mmap_t;
+
+/**
+ * @brief Usage of a single memory node by a mapping provider.
+ */
+typedef struct {
+	size_t blocks;          /**< Blocks currently handed out to pools.    */
+	size_t bytes;           /**< Bytes mapped for those blocks.           */
+	size_t cached_blocks;   /**< Released blocks kept for reuse.          */
+	size_t cached_bytes;    /**< Bytes mapped for the cached blocks.      */
+	size_t cache_hits;      /**< Acquisitions served from the cache.      */
+	size_t maps;            /**< Blocks mapped from the kernel.           */
+	size_t unmaps;          /**< Blocks returned to the kernel.           */
+} psca_mmap_node_stats_t;
+
+/**
+ * @brief Memory the kernel reports for the mappings of a pool.
+ *
+ * All sizes are in bytes.
+ *
+ * @see psca_mmap_smaps()
+ */
+typedef struct {
+	size_t mappings;        /**< Mappings named after the pool. The kernel
+	                             merges adjacent ones.                    */
+	size_t size;            /**< Address space they cover.                */
+	size_t resident;        /**< Resident pages.                          */
+	size_t dirty;           /**< Dirty pages.                             */
+	size_t swapped;         /**< Pages swapped out.                       */
+} psca_mmap_smaps_t;
+
+/**
+ * @brief Create a new mapping provider.
+ *
+ * @param[in]  flags    Zero or more of PSCA_MMAP_NUMA_BIND and
+ *                      PSCA_MMAP_NUMA_PREFAULT.
+ *
+ * @return              New provider or NULL on error.
+ *
+ * @see psca_mmap_destroy()
+ */
+psca_mmap_t psca_mmap_new(int flags);
+
+/**
+ * @brief Destroy a mapping provider, unmapping any cached blocks.
+ *
+ * Every pool using the provider must be destroyed first.
+ *
+ * @param[in]  m        The provider to destroy.
+ *
+ * @return              Returns 0 on success and -1 on error.
+ */
+int psca_mmap_destroy(psca_mmap_t m);
+
+/**
+ * @brief Set how many released blocks are cached per node.
+ *
+ * @param[in]  m        The provider.
+ *
+ * @param[in]  value    Number of blocks, 0 disables the cache. Blocks
+ *                      already cached are kept until they are reused.
+ */
+void psca_mmap_set_cache_size(psca_mmap_t m, size_t value);
+
+/**
+ * @brief Get the number of memory nodes seen by a provider.
+ *
+ * @param[in]  m        The provider.
+ *
+ * @return              One past the highest node online, 1 on hosts without
+ *                      NUMA. Nodes that are possible but not online, such
+ *                      as hotplug slots, are not counted.
+ */
+int psca_mmap_num_nodes(psca_mmap_t m);
+
+/**
+ * @brief Get the usage of a memory node.
+ *
+ * @param[in]  m        The provider.
+ *
+ * @param[in]  node     The node, from 0 to psca_mmap_num_nodes() - 1.
+ *
+ * @param[out] stats    Filled in with the usage of the node.
+ *
+ * @return              Returns 0 on success and -1 if there is no such
+ *                      node.
+ */
+int psca_mmap_node_stats(psca_mmap_t m, int node,
+                         psca_mmap_node_stats_t *stats);
+
+/**
+ * @brief Block allocation function mapping blocks.
+ *
+ * Matches psca_alloc_func_t, with the provider as the context.
+ */
+void *psca_mmap_alloc(size_t *size, void *context);
+
+/**
+ * @brief Block allocation function mapping blocks named after their pool.
+ *
+ * Matches psca_alloc_hint_func_t, with the provider as the context.
+ * Cached blocks are renamed when they are handed to another pool.
+ */
+void *psca_mmap_alloc_hint(size_t *size, const psca_alloc_hint_t *hint,
+                           void *context);
+
+/**
+ * @brief Block deallocation function caching or unmapping blocks.
+ *
+ * Matches psca_free_func_t, with the provider as the context.
+ */
+void psca_mmap_free(void *block, void *context);
+
+/**
+ * @brief Batch deallocation function caching or unmapping blocks.
+ *
+ * Matches psca_free_batch_func_t, with the provider as the context. Blocks
+ * that do not fit in the cache are sorted by address, and runs of
+ * adjacent mappings are unmapped with a single munmap() call.
+ */
+void psca_mmap_free_batch(psca_block_info_t *blocks, size_t count,
+                          void *context);
+
+/**
+ * @brief Make a pool allocate its blocks from a mapping provider.
+ *
+ * This is a shorthand for calling psca_set_funcs() with psca_mmap_alloc()
+ * and psca_mmap_free(), psca_set_alloc_hint_func() with
+ * psca_mmap_alloc_hint(), and psca_set_free_batch_func() with
+ * psca_mmap_free_batch().
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  m        The provider.
+ */
+void psca_set_mmap(psca_t pool, psca_mmap_t m);
+
+/**
+ * @brief Sum up what the kernel reports for the mappings of a pool.
+ *
+ * Parses /proc/self/smaps for the mappings named after the pool, to check
+ * the counters of the pool against what is actually resident. Blocks the
+ * provider caches after the pool released them keep the pool's name
+ * until they are reused, and are counted as well. Pools sharing a name
+ * are counted together.
+ *
+ * @param[in]   pool    The pool, which must be using a mapping provider.
+ *
+ * @param[out]  smaps   Where to store the sums, all zero if the kernel
+ *                      does not support naming mappings.
+ *
+ * @return              Returns 0 on success and -1 if smaps could not be
+ *                      read.
+ *
+ * @see psca_set_name()
+ */
+int psca_mmap_smaps(psca_t pool, psca_mmap_smaps_t *smaps);
+
+/** @} **********************************************************************/
+
+/**
+ * @defgroup psca_sites Allocation sites
+ *
+ * Exact accounting of allocations per call site. Allocations made with
+ * psca_malloc_tagged(), usually through PSCA_MALLOC(), are counted in a
+ * table shared by every pool and thread. Updating it takes no locks.
+ *
+ * The table holds up to 4096 sites. Allocations from further sites are
+ * only counted as a total.
+ *
+ * @{
+ */
+
+/**
+ * @brief Allocate memory, accounting it to a call site.
+ *
+ * When PSCA_TRACK_SITES is defined before including psca.h, this passes
+ * the location of the call to psca_malloc_tagged(). Otherwise it is plain
+ * psca_malloc(), so it costs nothing in builds that do not track sites.
+ */
+#ifdef PSCA_TRACK_SITES
+#define PSCA_MALLOC(_pool, _size) \
+	psca_malloc_tagged((_pool), (_size), __FILE__, __LINE__, __func__)
+#else
+#define PSCA_MALLOC(_pool, _size) psca_malloc((_pool), (_size))
+#endif
+
+/**
+ * @brief Allocations made from a call site.
+ */
+typedef struct {
+	const char *file;   /**< File of the call site.                      */
+	int         line;   /**< Line of the call site.                      */
+	const char *func;   /**< Function of the call site.                  */
+	size_t      count;  /**< Number of allocations made.                 */
+	size_t      bytes;  /**< Number of bytes requested.                  */
+} psca_site_t;
+
+/**
+ * @brief Allocate memory and account it to a call site.
+ *
+ * @param[in]  pool     The pool to allocate from.
+ *
+ * @param[in]  size     Number of bytes to allocate.
+ *
+ * @param[in]  file     File of the call site. Must be a string that lives
+ *                      as long as the program, as __FILE__ does.
+ *
+ * @param[in]  line     Line of the call site.
+ *
+ * @param[in]  func     Function of the call site, with the same lifetime
+ *                      requirements as `file`.
+ *
+ * @return              Allocated memory, NULL on error. Failed
+ *                      allocations are not accounted to the site.
+ *
+ * @see PSCA_MALLOC()
+ */
+void *psca_malloc_tagged(psca_t pool, size_t size, const char *file,
+                         int line, const char *func);
+
+/**
+ * @brief Get the allocation sites, by decreasing number of bytes.
+ *
+ * @param[out]  sites   Where to store the sites.
+ *
+ * @param[in]   max     Number of sites that fit in `sites`.
+ *
+ * @return              Number of known sites, which may be more than
+ *                      `max`. Only the largest sites of the first `max`
+ *                      found are stored in that case.
+ */
+size_t psca_get_sites(psca_site_t *sites, size_t max);
+
+/**
+ * @brief Write a report of the allocation sites, by decreasing number of
+ *        bytes.
+ *
+ * @param[in]  fd       The descriptor to write to.
+ *
+ * @return              Returns 0 on success and -1 on error.
+ */
+int psca_write_sites(int fd);
+
+/** @} **********************************************************************/
+
+/**
+ * @defgroup psca_trace Allocation traces
+ *
+ * A pool can record what is done with it to a compact binary trace, which
+ * the psca_replay tool plays back against other pool settings and
+ * providers.
+ *
+ * A trace starts with the 8 bytes of PSCA_TRACE_MAGIC and the number of
+ * frames on the stack when recording started, which psca_replay pushes
+ * before playing the trace. Records follow, made of a one-byte operation
+ * and its arguments. Numbers are encoded as unsigned LEB128:
+ *
+ * | Operation                 | Arguments                               |
+ * |---------------------------|-----------------------------------------|
+ * | PSCA_TRACE_PUSH           | label (an identifier, 0 for none)       |
+ * | PSCA_TRACE_POP            |                                         |
+ * | PSCA_TRACE_MALLOC         | size                                    |
+ * | PSCA_TRACE_MALLOC_IN      | frames below the top, size              |
+ * | PSCA_TRACE_RESERVE        | size                                    |
+ * | PSCA_TRACE_COMMIT         | size                                    |
+ * | PSCA_TRACE_MERGE          |                                         |
+ * | PSCA_TRACE_BLOCK_ACQUIRE  | usable size                             |
+ * | PSCA_TRACE_BLOCK_RELEASE  | usable size                             |
+ *
+ * Frames popped by psca_pop_to() are recorded one by one. Block events
+ * describe what the traced pool did and are not replayed. Blocks released
+ * by a reclaimer are not recorded.
+ *
+ * @{
+ */
+
+/**
+ * @brief First bytes of a trace.
+ */
+#define PSCA_TRACE_MAGIC "PSCATRC2"
+
+/**
+ * @brief Operations recorded in a trace.
+ */
+enum {
+	PSCA_TRACE_PUSH = 1,
+	PSCA_TRACE_POP,
+	PSCA_TRACE_MALLOC,
+	PSCA_TRACE_MALLOC_IN,
+	PSCA_TRACE_RESERVE,
+	PSCA_TRACE_COMMIT,
+	PSCA_TRACE_MERGE,
+	PSCA_TRACE_BLOCK_ACQUIRE,
+	PSCA_TRACE_BLOCK_RELEASE
+};
+
+/**
+ * @brief Start or stop recording a trace of a pool.
+ *
+ * Records are buffered and written to `fd` as the buffer fills up, when
+ * the trace is stopped, and when the pool is destroyed. The descriptor is
+ * never closed by the pool.
+ *
+ * @param[in]  pool     The pool to trace.
+ *
+ * @param[in]  fd       The descriptor to write the trace to, or -1 to stop
+ *                      recording. A trace being recorded is stopped
+ *                      before another one is started.
+ *
+ * @return              Returns 0 on success and -1 on error, including a
+ *                      failure to write out the previous trace.
+ */
+int psca_set_trace(psca_t pool, int fd);
+
+/** @} **********************************************************************/
+
+/**
+ * @defgroup psca_reclaim Background block release
+ *
+ * A reclaimer is a thread that releases blocks on behalf of pools. A pool
+ * using one hands the blocks of popped frames to it instead of calling
+ * its deallocation functions, so popping a frame costs the same no matter
+ * how many blocks the frame owned.
+ *
+ * A reclaimer can be shared by any number of pools and threads. It only
+ * queues up to a limited number of releases: when it falls behind, pools
+ * release blocks themselves until it catches up.
+ *
+ * The deallocation functions of a pool using a reclaimer are called on
+ * the reclaimer's thread, while the pool keeps acquiring blocks on its
+ * own thread, so its provider must be thread-safe. The default provider
+ * and the mapping and shared-memory providers are.
+ *
+ * @{
+ */
+
+/**
+ * @brief Handle for a reclaimer.
+ */
+typedef const void * psca_reclaimer_t;
+
+/**
+ * @brief Create a reclaimer and start its thread.
+ *
+ * @param[in]  limit    Number of releases that can be queued before pools
+ *                      fall back to releasing blocks themselves, or 0 for
+ *                      the default (256). Each pop counts as one release.
+ *
+ * @return              New reclaimer or NULL on error.
+ *
+ * @see psca_reclaimer_destroy()
+ */
+psca_reclaimer_t psca_reclaimer_new(size_t limit);
+
+/**
+ * @brief Stop a reclaimer, once everything queued has been released.
+ *
+ * @param[in]  r        The reclaimer to destroy.
+ *
+ * @return              Returns 0 on success and -1 on error.
+ *
+ * @warning             Pools must not hand anything to the reclaimer once
+ *                      this has been called. Providers must outlive the
+ *                      reclaimers that release their blocks.
+ */
+int psca_reclaimer_destroy(psca_reclaimer_t r);
+
+/**
+ * @brief Get the number of releases queued on a reclaimer.
+ *
+ * @param[in]  r        The reclaimer.
+ *
+ * @return              Number of releases not completed yet.
+ */
+size_t psca_reclaimer_pending(psca_reclaimer_t r);
+
+/**
+ * @brief Release the blocks of a pool on a reclaimer.
+ *
+ * Blocks set aside by psca_set_deferred_free() are not affected, and
+ * psca_drain() still releases them on the calling thread. Blocks too small
+ * to carry the bookkeeping of a release are also released by the pool.
+ *
+ * The pool's deallocation functions are then called on the reclaimer's
+ * thread, concurrently with its allocation functions on the pool's
+ * thread: the provider must be thread-safe.
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  r        The reclaimer, or NULL (the default) to release
+ *                      blocks on the thread popping frames.
+ */
+void psca_set_reclaimer(psca_t pool, psca_reclaimer_t r);
+
+/** @} **********************************************************************/
+
+/**
+ * @defgroup psca_export Live statistics
+ *
+ * A pool can publish its counters in a page of shared memory, so tools
+ * such as psca_top can watch it from another process. The page is a POSIX
+ * shared-memory object named `/psca.<pid>.<pool name>`, and is updated
+ * whenever the pool acquires or releases blocks and when frames are
+ * pushed, popped or merged, never on allocation. Readers use
+ * psca_read_export(), which retries until it gets a consistent copy.
+ *
+ * @{
+ */
+
+/**
+ * @brief Longest pool name, including the terminating null byte.
+ */
+#define PSCA_NAME_MAX (32)
+
+/**
+ * @brief What a pool publishes about itself.
+ *
+ * @see psca_read_export()
+ */
+typedef struct {
+	long         pid;                 /**< Process owning the pool.       */
+	char         name[PSCA_NAME_MAX]; /**< Name of the pool.              */
+	unsigned     depth;               /**< Frames on the stack.           */
+	size_t       peak_bytes;          /**< Most bytes held in blocks since
+	                                       the pool started publishing.   */
+	size_t       updates;             /**< Times the page was updated.    */
+	psca_stats_t stats;               /**< Counters of the pool.          */
+} psca_export_t;
+
+/**
+ * @brief Set the name of a pool.
+ *
+ * The name identifies the pool to tools looking at the process. Pools
+ * are named after their address until they are given a name.
+ *
+ * @param[in]  pool     The pool to name.
+ *
+ * @param[in]  name     The name, truncated to PSCA_NAME_MAX - 1 bytes. It
+ *                      may not contain a slash.
+ */
+void psca_set_name(psca_t pool, const char *name);
+
+/**
+ * @brief Get the name of a pool.
+ *
+ * @param[in]   pool    The pool.
+ *
+ * @param[out]  name    Where to store the name, which must have room for
+ *                      PSCA_NAME_MAX bytes. Pools that were not given a
+ *                      name are named after their address, in hex.
+ *
+ * @see psca_set_name()
+ */
+void psca_get_name(psca_t pool, char *name);
+
+/**
+ * @brief Start or stop publishing the counters of a pool.
+ *
+ * The page is named after the pool when publishing starts, and is
+ * removed when publishing stops and when the pool is destroyed. Starting
+ * again replaces the page, which picks up a new name.
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @param[in]  value    Non-zero to publish, zero to stop.
+ *
+ * @return              Returns 0 on success and -1 if the page could not
+ *                      be created, for instance because another pool of
+ *                      the process has the same name.
+ */
+int psca_set_export(psca_t pool, int value);
+
+/**
+ * @brief Read the counters published by a pool.
+ *
+ * This does not have to be called from the process owning the pool.
+ *
+ * @param[in]   path    Name of the shared-memory object, as in
+ *                      `/psca.1234.parser`.
+ *
+ * @param[out]  info    Where to store the counters.
+ *
+ * @return              Returns 0 on success and -1 if the object does not
+ *                      exist, is not a psca page, or kept changing while
+ *                      it was read.
+ */
+int psca_read_export(const char *path, psca_export_t *info);
+
 /** @} **********************************************************************/
 
 #ifdef __cplusplus
@@ -0,0 +1,604 @@
+/*
+ * Pool Stack C Allocator
+ *
+ * Copyright (C) Scott Kroll 2013
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include "psca.h"
+
+#define PSCA_MMAP_DEFAULT_CACHE_SIZE (8)
+
+/* from <numaif.h>, which is not installed everywhere */
+#ifndef MPOL_BIND
+#define MPOL_BIND (2)
+#endif
+
+/* from <linux/prctl.h>, Linux 5.17 and later */
+#ifndef PR_SET_VMA
+#define PR_SET_VMA (0x53564d41)
+#endif
+
+#ifndef PR_SET_VMA_ANON_NAME
+#define PR_SET_VMA_ANON_NAME (0)
+#endif
+
+/* longest name the kernel accepts for a mapping, including the null byte */
+#define PSCA_MMAP_LABEL_MAX (80)
+
+/*
+ * Every mapping starts with a chunk header describing it. The pool gets
+ * the memory right after the header. The header is kept when a block is
+ * sitting in a node cache, in which case `next` links the cached blocks.
+ * `label` is a hash of the name the mapping was given, so a cached block
+ * is only renamed when a pool with another name picks it up.
+ */
+struct psca_mmap_chunk {
+	struct psca_mmap_chunk *next;
+	size_t                  length;
+	int                     node;
+	int                     pad;
+	size_t                  label;
+};
+
+typedef struct psca_mmap_chunk psca_mmap_chunk_t;
+
+/*
+ * A node keeps a list of released blocks that were placed on it, so they
+ * can be handed out again to threads running on the same node without
+ * going back to the kernel.
+ */
+struct psca_mmap_node {
+	psca_mmap_chunk_t      *cache;
+	psca_mmap_node_stats_t  stats;
+};
+
+typedef struct psca_mmap_node psca_mmap_node_t;
+
+/*
+ * The provider is shared by every pool using it, possibly from several
+ * threads, so all of its state is protected by a lock. It is only taken
+ * when a pool acquires or releases a block.
+ */
+struct psca_mmap {
+	pthread_mutex_t   lock;
+	int               flags;
+	int               num_nodes;
+	size_t            cache_size;
+	size_t            page_size;
+	int               no_labels;
+	psca_mmap_node_t  nodes[PSCA_MMAP_MAX_NODES];
+};
+
+typedef struct psca_mmap psca_mmap_prov_t;
+
+#define PSCA_MMAP_P(_p) ((psca_mmap_prov_t *)(_p))
+
+/* counts the memory nodes online, from node 0 to the highest one online.
+ * The possible list also covers nodes that may be hotplugged later, which
+ * firmware often reports in the dozens on machines with two */
+static int
+psca_mmap_count_nodes(void)
+{
+	FILE *f = fopen("/sys/devices/system/node/online", "r");
+	int first;
+	int last;
+	int highest = 0;
+	int n;
+
+	if (f == NULL) {
+		return 1;
+	}
+
+	/* the list looks like "0", "0-3" or "0,2-3" */
+	do {
+		n = fscanf(f, "%d", &first);
+
+		if (n < 1) {
+			break;
+		}
+
+		last = first;
+		n = fgetc(f);
+
+		if ((n == '-') && (fscanf(f, "%d", &last) == 1)) {
+			n = fgetc(f);
+		}
+
+		if (last > highest) {
+			highest = last;
+		}
+	} while (n == ',');
+
+	fclose(f);
+
+	if (highest >= PSCA_MMAP_MAX_NODES) {
+		return PSCA_MMAP_MAX_NODES;
+	}
+
+	return highest + 1;
+}
+
+/* finds the node the calling thread is running on */
+static int
+psca_mmap_current_node(psca_mmap_prov_t *m)
+{
+	unsigned cpu;
+	unsigned node;
+
+	if (m->num_nodes == 1) {
+		return 0;
+	}
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1) {
+		return 0;
+	}
+
+	if (node >= (unsigned)m->num_nodes) {
+		return 0;
+	}
+
+	return (int)node;
+}
+
+/* places a fresh mapping on a node, per the provider flags */
+static void
+psca_mmap_place(psca_mmap_prov_t *m,
+                void             *addr,
+                size_t            length,
+                int               node)
+{
+	if ((m->flags & PSCA_MMAP_NUMA_BIND) && (m->num_nodes > 1)) {
+		unsigned long mask[PSCA_MMAP_MAX_NODES / (8 * sizeof(unsigned long)) + 1];
+
+		memset(mask, 0, sizeof(mask));
+		mask[node / (8 * sizeof(unsigned long))] |=
+		    1UL << (node % (8 * sizeof(unsigned long)));
+
+		/* placement is best effort, the memory is usable either way */
+		syscall(SYS_mbind, addr, length, MPOL_BIND, mask,
+		        (unsigned long)PSCA_MMAP_MAX_NODES + 1, 0);
+	}
+
+	if (m->flags & PSCA_MMAP_NUMA_PREFAULT) {
+		volatile uint8_t *p = addr;
+		size_t off;
+
+		/* first touch from this thread puts the pages on its node */
+		for (off = 0; off < length; off += m->page_size) {
+			p[off] = 0;
+		}
+	}
+}
+
+/* builds the name mappings of a pool are given */
+static void
+psca_mmap_label_name(const char *name,                       /* in: name of the pool */
+                     char        label[PSCA_MMAP_LABEL_MAX]) /* in: where to store it */
+{
+	char *c;
+
+	snprintf(label, PSCA_MMAP_LABEL_MAX, "psca:%s", name);
+
+	/* the kernel refuses names with these in them */
+	for (c = label; *c != '\0'; c++) {
+		if ((*c < ' ') || (*c > '~') || (strchr("[]\\$`", *c) != NULL)) {
+			*c = '_';
+		}
+	}
+}
+
+/* names a mapping after the pool it is handed to, so it can be told apart
+ * in /proc/<pid>/maps and smaps */
+static void
+psca_mmap_label(psca_mmap_prov_t  *m,     /* in: the provider */
+                psca_mmap_chunk_t *chunk, /* in: the mapping */
+                const char        *name)  /* in: name of the pool */
+{
+	char label[PSCA_MMAP_LABEL_MAX];
+	size_t hash = 0xcbf29ce484222325ULL;
+	const char *c;
+
+	for (c = name; *c != '\0'; c++) {
+		hash = (hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+	}
+
+	if ((chunk->label == hash) ||
+	    __atomic_load_n(&m->no_labels, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	psca_mmap_label_name(name, label);
+
+	/* kernels without CONFIG_ANON_VMA_NAME refuse, and keep refusing */
+	if ((prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, (unsigned long)chunk,
+	           chunk->length, (unsigned long)label) == -1) &&
+	    (errno == EINVAL)) {
+		__atomic_store_n(&m->no_labels, 1, __ATOMIC_RELAXED);
+	}
+
+	chunk->label = hash;
+}
+
+psca_mmap_t
+psca_mmap_new(int flags)
+{
+	psca_mmap_prov_t *m = malloc(sizeof(psca_mmap_prov_t));
+
+	if (m == NULL) {
+		return NULL;
+	}
+
+	memset(m, 0, sizeof(psca_mmap_prov_t));
+
+	if (pthread_mutex_init(&m->lock, NULL) != 0) {
+		free(m);
+		return NULL;
+	}
+
+	m->flags = flags;
+	m->num_nodes = psca_mmap_count_nodes();
+	m->cache_size = PSCA_MMAP_DEFAULT_CACHE_SIZE;
+	m->page_size = getpagesize();
+
+	return m;
+}
+
+int
+psca_mmap_destroy(psca_mmap_t p)
+{
+	psca_mmap_prov_t *m = PSCA_MMAP_P(p);
+	int i;
+
+	if (m == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < m->num_nodes; i++) {
+		psca_mmap_chunk_t *chunk = m->nodes[i].cache;
+
+		while (chunk) {
+			psca_mmap_chunk_t *next = chunk->next;
+
+			munmap(chunk, chunk->length);
+
+			chunk = next;
+		}
+	}
+
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+
+	return 0;
+}
+
+void
+psca_mmap_set_cache_size(psca_mmap_t p,
+                         size_t      value)
+{
+	psca_mmap_prov_t *m = PSCA_MMAP_P(p);
+
+	pthread_mutex_lock(&m->lock);
+	m->cache_size = value;
+	pthread_mutex_unlock(&m->lock);
+}
+
+int
+psca_mmap_num_nodes(psca_mmap_t p)
+{
+	return PSCA_MMAP_P(p)->num_nodes;
+}
+
+int
+psca_mmap_node_stats(psca_mmap_t             p,
+                     int                     node,
+                     psca_mmap_node_stats_t *stats)
+{
+	psca_mmap_prov_t *m = PSCA_MMAP_P(p);
+
+	if ((node < 0) || (node >= m->num_nodes)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&m->lock);
+	*stats = m->nodes[node].stats;
+	pthread_mutex_unlock(&m->lock);
+
+	return 0;
+}
+
+/* maps a block, or takes one from the cache, and names it if asked to */
+static void *
+psca_mmap_get(psca_mmap_prov_t *m,    /* in: the provider */
+              size_t           *size, /* in: requested size, out: usable size */
+              const char       *name) /* in: name of the pool, or NULL */
+{
+	psca_mmap_chunk_t *chunk;
+	psca_mmap_chunk_t **link;
+	psca_mmap_node_t *n;
+	size_t length = *size + sizeof(psca_mmap_chunk_t);
+	int node = psca_mmap_current_node(m);
+
+	length = (length + m->page_size - 1) & ~(m->page_size - 1);
+	n = &m->nodes[node];
+
+	pthread_mutex_lock(&m->lock);
+
+	/* reuse a cached block that fits without wasting more than half of it */
+	for (link = &n->cache; *link != NULL; link = &(*link)->next) {
+		chunk = *link;
+
+		if ((chunk->length >= length) && (chunk->length / 2 <= length)) {
+			*link = chunk->next;
+
+			n->stats.cached_blocks--;
+			n->stats.cached_bytes -= chunk->length;
+			n->stats.cache_hits++;
+			n->stats.blocks++;
+			n->stats.bytes += chunk->length;
+
+			pthread_mutex_unlock(&m->lock);
+
+			if (name != NULL) {
+				psca_mmap_label(m, chunk, name);
+			}
+
+			*size = chunk->length - sizeof(psca_mmap_chunk_t);
+
+			return (void *)(chunk + 1);
+		}
+	}
+
+	pthread_mutex_unlock(&m->lock);
+
+	chunk = mmap(NULL, length, PROT_READ | PROT_WRITE,
+	             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (chunk == MAP_FAILED) {
+		return NULL;
+	}
+
+	psca_mmap_place(m, chunk, length, node);
+
+	chunk->next = NULL;
+	chunk->length = length;
+	chunk->node = node;
+	chunk->label = 0;
+
+	if (name != NULL) {
+		psca_mmap_label(m, chunk, name);
+	}
+
+	pthread_mutex_lock(&m->lock);
+	n->stats.maps++;
+	n->stats.blocks++;
+	n->stats.bytes += length;
+	pthread_mutex_unlock(&m->lock);
+
+	*size = length - sizeof(psca_mmap_chunk_t);
+
+	return (void *)(chunk + 1);
+}
+
+void *
+psca_mmap_alloc(size_t *size,
+                void   *context)
+{
+	return psca_mmap_get(PSCA_MMAP_P(context), size, NULL);
+}
+
+void *
+psca_mmap_alloc_hint(size_t                  *size,
+                     const psca_alloc_hint_t *hint,
+                     void                    *context)
+{
+	return psca_mmap_get(PSCA_MMAP_P(context), size, hint->name);
+}
+
+void
+psca_mmap_free(void *block,
+               void *context)
+{
+	psca_mmap_prov_t *m = PSCA_MMAP_P(context);
+	psca_mmap_chunk_t *chunk = (psca_mmap_chunk_t *)block - 1;
+	psca_mmap_node_t *n = &m->nodes[chunk->node];
+
+	pthread_mutex_lock(&m->lock);
+
+	n->stats.blocks--;
+	n->stats.bytes -= chunk->length;
+
+	if (n->stats.cached_blocks < m->cache_size) {
+		chunk->next = n->cache;
+		n->cache = chunk;
+
+		n->stats.cached_blocks++;
+		n->stats.cached_bytes += chunk->length;
+
+		pthread_mutex_unlock(&m->lock);
+
+		return;
+	}
+
+	n->stats.unmaps++;
+
+	pthread_mutex_unlock(&m->lock);
+
+	munmap(chunk, chunk->length);
+}
+
+/* orders blocks by address */
+static int
+psca_mmap_cmp(const void *a,
+              const void *b)
+{
+	uintptr_t x = (uintptr_t)((const psca_block_info_t *)a)->block;
+	uintptr_t y = (uintptr_t)((const psca_block_info_t *)b)->block;
+
+	return (x > y) - (x < y);
+}
+
+void
+psca_mmap_free_batch(psca_block_info_t *blocks,
+                     size_t             count,
+                     void              *context)
+{
+	psca_mmap_prov_t *m = PSCA_MMAP_P(context);
+	size_t kept = 0;
+	size_t i;
+
+	pthread_mutex_lock(&m->lock);
+
+	/* fill the node caches first, and move whatever is left over to the
+	 * front of the array */
+	for (i = 0; i < count; i++) {
+		psca_mmap_chunk_t *chunk = (psca_mmap_chunk_t *)blocks[i].block - 1;
+		psca_mmap_node_t *n = &m->nodes[chunk->node];
+
+		n->stats.blocks--;
+		n->stats.bytes -= chunk->length;
+
+		if (n->stats.cached_blocks < m->cache_size) {
+			chunk->next = n->cache;
+			n->cache = chunk;
+
+			n->stats.cached_blocks++;
+			n->stats.cached_bytes += chunk->length;
+		} else {
+			n->stats.unmaps++;
+			blocks[kept++] = blocks[i];
+		}
+	}
+
+	pthread_mutex_unlock(&m->lock);
+
+	qsort(blocks, kept, sizeof(*blocks), psca_mmap_cmp);
+
+	/* unmap runs of mappings that follow each other in memory at once */
+	for (i = 0; i < kept; ) {
+		psca_mmap_chunk_t *start = (psca_mmap_chunk_t *)blocks[i].block - 1;
+		uintptr_t end = (uintptr_t)start + start->length;
+
+		for (i++; i < kept; i++) {
+			psca_mmap_chunk_t *chunk = (psca_mmap_chunk_t *)blocks[i].block - 1;
+
+			if ((uintptr_t)chunk != end) {
+				break;
+			}
+
+			end += chunk->length;
+		}
+
+		munmap(start, end - (uintptr_t)start);
+	}
+}
+
+void
+psca_set_mmap(psca_t      pool,
+              psca_mmap_t m)
+{
+	psca_set_funcs(pool, psca_mmap_alloc, psca_mmap_free, (void *)m);
+	psca_set_alloc_hint_func(pool, psca_mmap_alloc_hint);
+	psca_set_free_batch_func(pool, psca_mmap_free_batch);
+}
+
+/* reads a size field of smaps, in kB, into a byte count */
+static void
+psca_mmap_smaps_field(const char *line, /* in: the line of smaps */
+                      const char *key,  /* in: the field, with its colon */
+                      size_t     *out)  /* in: counter to add the size to */
+{
+	size_t len = strlen(key);
+	unsigned long kb;
+
+	if ((strncmp(line, key, len) == 0) &&
+	    (sscanf(line + len, "%lu", &kb) == 1)) {
+		*out += (size_t)kb * 1024;
+	}
+}
+
+int
+psca_mmap_smaps(psca_t             pool,
+                psca_mmap_smaps_t *smaps)
+{
+	FILE *f = fopen("/proc/self/smaps", "r");
+	char name[PSCA_NAME_MAX];
+	char label[PSCA_MMAP_LABEL_MAX];
+	char want[PSCA_MMAP_LABEL_MAX + 8];
+	char line[512];
+	int in_pool = 0;
+
+	if (f == NULL) {
+		return -1;
+	}
+
+	psca_get_name(pool, name);
+	psca_mmap_label_name(name, label);
+	snprintf(want, sizeof(want), "[anon:%s]", label);
+
+	memset(smaps, 0, sizeof(psca_mmap_smaps_t));
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned long start;
+		unsigned long end;
+		size_t len = strlen(line);
+
+		/* a mapping starts with its address range, and its name if it has
+		 * one comes last on the line */
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			while ((len > 0) && (line[len - 1] == '\n')) {
+				line[--len] = '\0';
+			}
+
+			in_pool = (len >= strlen(want)) &&
+			          (strcmp(line + len - strlen(want), want) == 0);
+
+			if (in_pool) {
+				smaps->mappings++;
+			}
+
+			continue;
+		}
+
+		if (!in_pool) {
+			continue;
+		}
+
+		psca_mmap_smaps_field(line, "Size:", &smaps->size);
+		psca_mmap_smaps_field(line, "Rss:", &smaps->resident);
+		psca_mmap_smaps_field(line, "Shared_Dirty:", &smaps->dirty);
+		psca_mmap_smaps_field(line, "Private_Dirty:", &smaps->dirty);
+		psca_mmap_smaps_field(line, "Swap:", &smaps->swapped);
+	}
+
+	fclose(f);
+
+	return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * Pool Stack C Allocator
+ *
+ * Copyright (C) Scott Kroll 2013
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "psca.h"
+
+#define PSCA_SHM_MAGIC UINT64_C(0x7073636173686d31) /* "pscashm1" */
+#define PSCA_SHM_ALIGN (16)
+
+/*
+ * The header lives at the very start of the segment so that a process
+ * attaching to it can find out where the segment has to be mapped and
+ * where the builder left its data. Everything after the header is handed
+ * out to the pool as blocks, bump-allocator style.
+ */
+struct psca_shm_header {
+	uint64_t  magic;
+	uintptr_t base;
+	size_t    size;
+	size_t    top;
+	uintptr_t root;
+};
+
+typedef struct psca_shm_header psca_shm_header_t;
+
+/*
+ * Every block handed to the pool is prefixed with its length, so a block
+ * that is released while it is the last one in the segment can be given
+ * back by moving the top offset. Since frames are popped in stack order,
+ * and release their blocks in the order they took them, that is the case
+ * for blocks released by psca_pop() unless psca_malloc_in() is used.
+ */
+struct psca_shm_chunk {
+	size_t size;
+	size_t pad;
+};
+
+typedef struct psca_shm_chunk psca_shm_chunk_t;
+
+/*
+ * The process-local handle for a segment. This is exposed to the user as
+ * an opaque pointer. The lock protects the top offset, since a pool using
+ * a reclaimer releases blocks from another thread.
+ */
+struct psca_shm {
+	pthread_mutex_t    lock;
+	psca_shm_header_t *header;
+	size_t             size;
+	int                fd;
+	int                writable;
+};
+
+typedef struct psca_shm psca_shm_seg_t;
+
+#define PSCA_SHM_P(_p) ((psca_shm_seg_t *)(_p))
+#define PSCA_SHM_ALIGN_UP(_s) \
+	(((_s) + (PSCA_SHM_ALIGN - 1)) & ~((size_t)PSCA_SHM_ALIGN - 1))
+
+/* maps the segment at the requested address without clobbering anything
+ * that is already mapped there */
+static void *
+psca_shm_map(int     fd,   /* in: descriptor of the segment */
+             void   *addr, /* in: required address, or NULL for any */
+             size_t  size, /* in: size of the segment */
+             int     prot) /* in: protection for the mapping */
+{
+	int flags = MAP_SHARED;
+	void *base;
+
+#ifdef MAP_FIXED_NOREPLACE
+	if (addr != NULL) {
+		flags |= MAP_FIXED_NOREPLACE;
+	}
+#endif
+
+	base = mmap(addr, size, prot, flags, fd, 0);
+
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* older kernels treat the address as a hint only */
+	if ((addr != NULL) && (base != addr)) {
+		munmap(base, size);
+		return NULL;
+	}
+
+	return base;
+}
+
+/* creates the backing file for a new segment */
+static int
+psca_shm_open(const char *name)
+{
+#ifdef MFD_CLOEXEC
+	return memfd_create(name, MFD_CLOEXEC);
+#else
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "/psca.%ld", (long)getpid());
+
+	fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+	if (fd != -1) {
+		shm_unlink(path);
+	}
+
+	return fd;
+#endif
+}
+
+psca_shm_t
+psca_shm_create(const char *name,
+                size_t      size,
+                void       *addr)
+{
+	psca_shm_seg_t *shm;
+	psca_shm_header_t *header;
+	size_t pagelessone = getpagesize() - 1;
+
+	size = (size + pagelessone) & ~pagelessone;
+
+	if (size <= sizeof(psca_shm_header_t)) {
+		return NULL;
+	}
+
+	shm = malloc(sizeof(psca_shm_seg_t));
+
+	if (shm == NULL) {
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&shm->lock, NULL) != 0) {
+		free(shm);
+		return NULL;
+	}
+
+	shm->fd = psca_shm_open(name != NULL ? name : "psca");
+
+	if (shm->fd == -1) {
+		goto fail_free;
+	}
+
+	if (ftruncate(shm->fd, size) == -1) {
+		goto fail_close;
+	}
+
+	header = psca_shm_map(shm->fd, addr, size, PROT_READ | PROT_WRITE);
+
+	if (header == NULL) {
+		goto fail_close;
+	}
+
+	header->magic = PSCA_SHM_MAGIC;
+	header->base = (uintptr_t)header;
+	header->size = size;
+	header->top = PSCA_SHM_ALIGN_UP(sizeof(psca_shm_header_t));
+	header->root = 0;
+
+	shm->header = header;
+	shm->size = size;
+	shm->writable = 1;
+
+	return shm;
+
+fail_close:
+	close(shm->fd);
+fail_free:
+	pthread_mutex_destroy(&shm->lock);
+	free(shm);
+
+	return NULL;
+}
+
+psca_shm_t
+psca_shm_attach(int fd)
+{
+	psca_shm_seg_t *shm;
+	psca_shm_header_t probe;
+	void *base;
+
+	/* the header tells us where the builder mapped the segment */
+	if (pread(fd, &probe, sizeof(probe), 0) != sizeof(probe)) {
+		return NULL;
+	}
+
+	if (probe.magic != PSCA_SHM_MAGIC) {
+		return NULL;
+	}
+
+	shm = malloc(sizeof(psca_shm_seg_t));
+
+	if (shm == NULL) {
+		return NULL;
+	}
+
+	base = psca_shm_map(fd, (void *)probe.base, probe.size, PROT_READ);
+
+	if ((base == NULL) || (pthread_mutex_init(&shm->lock, NULL) != 0)) {
+		if (base != NULL) {
+			munmap(base, probe.size);
+		}
+
+		free(shm);
+		return NULL;
+	}
+
+	shm->header = base;
+	shm->size = probe.size;
+	shm->fd = dup(fd);
+	shm->writable = 0;
+
+	return shm;
+}
+
+int
+psca_shm_destroy(psca_shm_t p)
+{
+	psca_shm_seg_t *shm = PSCA_SHM_P(p);
+
+	if (shm == NULL) {
+		return -1;
+	}
+
+	munmap(shm->header, shm->size);
+
+	if (shm->fd != -1) {
+		close(shm->fd);
+	}
+
+	pthread_mutex_destroy(&shm->lock);
+	free(shm);
+
+	return 0;
+}
+
+int
+psca_shm_fd(psca_shm_t p)
+{
+	return PSCA_SHM_P(p)->fd;
+}
+
+void *
+psca_shm_base(psca_shm_t p)
+{
+	return PSCA_SHM_P(p)->header;
+}
+
+int
+psca_shm_set_root(psca_shm_t  p,
+                  const void *root)
+{
+	psca_shm_seg_t *shm = PSCA_SHM_P(p);
+
+	if (!shm->writable) {
+		return -1;
+	}
+
+	/* readers may be polling for the root, so everything the builder wrote
+	 * before publishing it has to be visible first */
+	__atomic_store_n(&shm->header->root, (uintptr_t)root, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void *
+psca_shm_root(psca_shm_t p)
+{
+	psca_shm_seg_t *shm = PSCA_SHM_P(p);
+
+	return (void *)__atomic_load_n(&shm->header->root, __ATOMIC_ACQUIRE);
+}
+
+void *
+psca_shm_alloc(size_t *size,
+               void   *context)
+{
+	psca_shm_seg_t *shm = PSCA_SHM_P(context);
+	psca_shm_header_t *header = shm->header;
+	psca_shm_chunk_t *chunk;
+	size_t sz = PSCA_SHM_ALIGN_UP(*size);
+
+	if (!shm->writable) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&shm->lock);
+
+	if (sz + sizeof(psca_shm_chunk_t) > header->size - header->top) {
+		pthread_mutex_unlock(&shm->lock);
+		return NULL;
+	}
+
+	chunk = (psca_shm_chunk_t *)((uintptr_t)header + header->top);
+	chunk->size = sz;
+
+	header->top += sizeof(psca_shm_chunk_t) + sz;
+
+	pthread_mutex_unlock(&shm->lock);
+
+	*size = sz;
+
+	return (void *)(chunk + 1);
+}
+
+void
+psca_shm_free(void *block,
+              void *context)
+{
+	psca_shm_seg_t *shm = PSCA_SHM_P(context);
+	psca_shm_header_t *header = shm->header;
+	psca_shm_chunk_t *chunk = (psca_shm_chunk_t *)block - 1;
+	size_t offset = (uintptr_t)chunk - (uintptr_t)header;
+
+	pthread_mutex_lock(&shm->lock);
+
+	/* only the last block in the segment can be given back, anything else
+	 * stays in place until the segment is destroyed */
+	if (offset + sizeof(psca_shm_chunk_t) + chunk->size == header->top) {
+		header->top = offset;
+	}
+
+	pthread_mutex_unlock(&shm->lock);
+}
+
+void
+psca_set_shm(psca_t     pool,
+             psca_shm_t shm)
+{
+	psca_set_funcs(pool, psca_shm_alloc, psca_shm_free, (void *)shm);
+}
@@ -0,0 +1,203 @@
+/*
+ * Pool Stack C Allocator
+ *
+ * Copyright (C) Scott Kroll 2013
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+
+#include "psca.h"
+
+#define PSCA_SITES_SIZE (4096)
+
+#define PSCA_SITE_EMPTY    (0)
+#define PSCA_SITE_CLAIMED  (1)
+#define PSCA_SITE_READY    (2)
+
+/*
+ * Call sites are kept in a fixed-size open-addressing table shared by
+ * every pool and thread. A thread adding a site claims an empty slot with
+ * a compare-and-swap on its state, fills in the key and marks it ready.
+ * Slots are never freed, so lookups only ever have to wait for a slot
+ * that is being filled in.
+ */
+struct psca_site_slot {
+	int         state;
+	int         line;
+	const char *file;
+	const char *func;
+	size_t      count;
+	size_t      bytes;
+};
+
+typedef struct psca_site_slot psca_site_slot_t;
+
+static psca_site_slot_t psca_sites[PSCA_SITES_SIZE];
+
+/* allocations from sites that did not fit in the table */
+static size_t psca_sites_dropped;
+
+/* finds or adds the slot of a call site */
+static psca_site_slot_t *
+psca_site_get(const char *file, /* in: file of the call site */
+              int         line, /* in: line of the call site */
+              const char *func) /* in: function of the call site */
+{
+	uintptr_t hash = (uintptr_t)file * 31 + (uintptr_t)line;
+	size_t i;
+	size_t n;
+
+	/* file names are static strings, so the address identifies them */
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6dU;
+	hash ^= hash >> 12;
+
+	for (i = hash % PSCA_SITES_SIZE, n = 0; n < PSCA_SITES_SIZE;
+	     i = (i + 1) % PSCA_SITES_SIZE, n++) {
+		psca_site_slot_t *slot = &psca_sites[i];
+		int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+		if (state == PSCA_SITE_EMPTY) {
+			if (__atomic_compare_exchange_n(&slot->state, &state,
+			                                PSCA_SITE_CLAIMED, 0,
+			                                __ATOMIC_ACQUIRE,
+			                                __ATOMIC_ACQUIRE)) {
+				slot->file = file;
+				slot->line = line;
+				slot->func = func;
+
+				__atomic_store_n(&slot->state, PSCA_SITE_READY,
+				                 __ATOMIC_RELEASE);
+
+				return slot;
+			}
+		}
+
+		/* another thread is filling the slot in, it may be this site */
+		while (state == PSCA_SITE_CLAIMED) {
+			sched_yield();
+			state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		}
+
+		if ((slot->file == file) && (slot->line == line)) {
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+void *
+psca_malloc_tagged(psca_t      pool,
+                   size_t      size,
+                   const char *file,
+                   int         line,
+                   const char *func)
+{
+	void *ptr = psca_malloc_wrapped(pool, size);
+	psca_site_slot_t *slot;
+
+	/* failed allocations are not accounted */
+	if (ptr == NULL) {
+		return NULL;
+	}
+
+	slot = psca_site_get(file, line, func);
+
+	if (slot != NULL) {
+		__atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&slot->bytes, size, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&psca_sites_dropped, 1, __ATOMIC_RELAXED);
+	}
+
+	return ptr;
+}
+
+/* orders sites by decreasing number of bytes */
+static int
+psca_site_cmp(const void *a,
+              const void *b)
+{
+	size_t x = ((const psca_site_t *)a)->bytes;
+	size_t y = ((const psca_site_t *)b)->bytes;
+
+	return (x < y) - (x > y);
+}
+
+size_t
+psca_get_sites(psca_site_t *sites,
+               size_t       max)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < PSCA_SITES_SIZE; i++) {
+		psca_site_slot_t *slot = &psca_sites[i];
+
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != PSCA_SITE_READY) {
+			continue;
+		}
+
+		if (count < max) {
+			sites[count].file = slot->file;
+			sites[count].line = slot->line;
+			sites[count].func = slot->func;
+			sites[count].count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+			sites[count].bytes = __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+		}
+
+		count++;
+	}
+
+	qsort(sites, count < max ? count : max, sizeof(psca_site_t), psca_site_cmp);
+
+	return count;
+}
+
+int
+psca_write_sites(int fd)
+{
+	psca_site_t *sites = malloc(PSCA_SITES_SIZE * sizeof(psca_site_t));
+	size_t count;
+	size_t i;
+
+	if (sites == NULL) {
+		return -1;
+	}
+
+	count = psca_get_sites(sites, PSCA_SITES_SIZE);
+
+	dprintf(fd, "%14s %10s  %s\n", "bytes", "count", "site");
+
+	for (i = 0; i < count; i++) {
+		dprintf(fd, "%14zu %10zu  %s:%d (%s)\n", sites[i].bytes,
+		        sites[i].count, sites[i].file, sites[i].line, sites[i].func);
+	}
+
+	if (psca_sites_dropped != 0) {
+		dprintf(fd, "%14s %10zu  (sites past the table size)\n", "?",
+		        __atomic_load_n(&psca_sites_dropped, __ATOMIC_RELAXED));
+	}
+
+	free(sites);
+
+	return 0;
+}
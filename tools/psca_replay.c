@@ -0,0 +1,474 @@
+/*
+ * Pool Stack C Allocator
+ *
+ * Copyright (C) Scott Kroll 2013
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Plays back a trace recorded with psca_set_trace() against a pool
+ * configured from the command line, and reports what it cost.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <psca.h>
+
+#define MAX_LABELS (1024)
+
+/*
+ * Wraps the provider under test to count what the pool asks of it.
+ */
+typedef struct {
+	psca_alloc_func_t      alloc_func;
+	psca_free_func_t       free_func;
+	psca_free_batch_func_t free_batch_func;
+	void                  *context;
+
+	size_t allocs;
+	size_t frees;
+	size_t batches;
+	size_t bytes;
+	size_t peak_bytes;
+} r_provider_t;
+
+/*
+ * Keeps track of what the replayed program had allocated, to tell how
+ * much of the provider's memory the pool wasted.
+ */
+typedef struct {
+	const void **frames;
+	size_t      *used;
+	size_t       depth;
+	size_t       cap;
+	size_t       live;
+	size_t       peak_live;
+} r_stack_t;
+
+static r_provider_t g_prov;
+
+/* labels are identified by the address they had in the traced program */
+static uint64_t g_label_ids[MAX_LABELS];
+static char g_labels[MAX_LABELS][24];
+static size_t g_num_labels;
+
+static void *
+r_alloc(size_t *size, void *context)
+{
+	void *block = g_prov.alloc_func(size, g_prov.context);
+
+	if (block != NULL) {
+		g_prov.allocs++;
+		g_prov.bytes += *size;
+
+		if (g_prov.bytes > g_prov.peak_bytes) {
+			g_prov.peak_bytes = g_prov.bytes;
+		}
+	}
+
+	return block;
+}
+
+/* only used if the pool cannot gather a batch, in which case the bytes
+ * given back are not known */
+static void
+r_free(void *block, void *context)
+{
+	g_prov.frees++;
+	g_prov.free_func(block, g_prov.context);
+}
+
+static void
+r_free_batch(psca_block_info_t *blocks, size_t count, void *context)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		g_prov.bytes -= blocks[i].size;
+	}
+
+	g_prov.frees += count;
+	g_prov.batches++;
+
+	if (g_prov.free_batch_func != NULL) {
+		g_prov.free_batch_func(blocks, count, g_prov.context);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		g_prov.free_func(blocks[i].block, g_prov.context);
+	}
+}
+
+static void *
+r_malloc_alloc(size_t *size, void *context)
+{
+	return malloc(*size);
+}
+
+static void
+r_malloc_free(void *block, void *context)
+{
+	free(block);
+}
+
+static const char *
+r_label(uint64_t id)
+{
+	size_t i;
+
+	if (id == 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < g_num_labels; i++) {
+		if (g_label_ids[i] == id) {
+			return g_labels[i];
+		}
+	}
+
+	if (g_num_labels == MAX_LABELS) {
+		return g_labels[0];
+	}
+
+	g_label_ids[g_num_labels] = id;
+	snprintf(g_labels[g_num_labels], sizeof(g_labels[0]), "label%zu",
+	         g_num_labels);
+
+	return g_labels[g_num_labels++];
+}
+
+static int
+r_read_num(FILE *f, uint64_t *value)
+{
+	int shift = 0;
+	int c;
+
+	*value = 0;
+
+	while ((c = fgetc(f)) != EOF) {
+		*value |= (uint64_t)(c & 0x7f) << shift;
+
+		if (!(c & 0x80)) {
+			return 0;
+		}
+
+		shift += 7;
+	}
+
+	return -1;
+}
+
+static void
+r_account(r_stack_t *s, size_t size)
+{
+	s->used[s->depth - 1] += size;
+	s->live += size;
+
+	if (s->live > s->peak_live) {
+		s->peak_live = s->live;
+	}
+}
+
+static int
+r_push(r_stack_t *s, psca_t pool, const char *label)
+{
+	if (s->depth == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 64;
+		s->frames = realloc(s->frames, s->cap * sizeof(*s->frames));
+		s->used = realloc(s->used, s->cap * sizeof(*s->used));
+
+		if ((s->frames == NULL) || (s->used == NULL)) {
+			return -1;
+		}
+	}
+
+	s->frames[s->depth] = psca_push_label(pool, label);
+	s->used[s->depth] = 0;
+	s->depth++;
+
+	return 0;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "usage: %s [options] trace\n"
+	    "\n"
+	    "  -b size    block size\n"
+	    "  -g factor  growth factor\n"
+	    "  -G factor  block growth\n"
+	    "  -m size    maximum block size\n"
+	    "  -a size    adaptive limit\n"
+	    "  -l count   release limit\n"
+	    "  -p name    provider: malloc (default) or mmap\n", prog);
+}
+
+int
+main(int    argc,
+     char **argv)
+{
+	r_stack_t s;
+	psca_t pool;
+	psca_mmap_t mmap_prov = NULL;
+	struct timespec start;
+	struct timespec end;
+	struct rusage ru;
+	size_t ops = 0;
+	FILE *f;
+	char magic[sizeof(PSCA_TRACE_MAGIC) - 1];
+	uint64_t a;
+	int c;
+
+	memset(&s, 0, sizeof(s));
+
+	pool = psca_new();
+
+	g_prov.alloc_func = r_malloc_alloc;
+	g_prov.free_func = r_malloc_free;
+
+	while ((c = getopt(argc, argv, "b:g:G:m:a:l:p:")) != -1) {
+		switch (c) {
+		case 'b':
+			psca_set_block_size(pool, strtoul(optarg, NULL, 0));
+			break;
+		case 'g':
+			psca_set_growth_factor(pool, atoi(optarg));
+			break;
+		case 'G':
+			psca_set_block_growth(pool, atoi(optarg));
+			break;
+		case 'm':
+			psca_set_max_block_size(pool, strtoul(optarg, NULL, 0));
+			break;
+		case 'a':
+			psca_set_adaptive_limit(pool, strtoul(optarg, NULL, 0));
+			break;
+		case 'l':
+			psca_set_release_limit(pool, strtoul(optarg, NULL, 0));
+			break;
+		case 'p':
+			if (strcmp(optarg, "mmap") == 0) {
+				mmap_prov = psca_mmap_new(0);
+				g_prov.alloc_func = psca_mmap_alloc;
+				g_prov.free_func = psca_mmap_free;
+				g_prov.free_batch_func = psca_mmap_free_batch;
+				g_prov.context = (void *)mmap_prov;
+			} else if (strcmp(optarg, "malloc") != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[optind], "rb");
+
+	if (f == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if ((fread(magic, sizeof(magic), 1, f) != 1) ||
+	    (memcmp(magic, PSCA_TRACE_MAGIC, sizeof(magic)) != 0)) {
+		fprintf(stderr, "%s: not a psca trace\n", argv[optind]);
+		return 1;
+	}
+
+	if (r_read_num(f, &a) != 0) {
+		goto truncated;
+	}
+
+	/* every block goes through the batch function, so the wrapper sees
+	 * the size of each block it gives back */
+	psca_set_funcs(pool, r_alloc, r_free, NULL);
+	psca_set_free_batch_func(pool, r_free_batch);
+
+	/* the frames the traced pool had when recording started */
+	for (; a > 0; a--) {
+		if (r_push(&s, pool, NULL) != 0) {
+			goto nomem;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while ((c = fgetc(f)) != EOF) {
+		uint64_t b = 0;
+
+		a = 0;
+
+		ops++;
+
+		switch (c) {
+		case PSCA_TRACE_PUSH:
+			if (r_read_num(f, &a) != 0) {
+				goto truncated;
+			}
+
+			if (r_push(&s, pool, r_label(a)) != 0) {
+				goto nomem;
+			}
+			break;
+
+		case PSCA_TRACE_POP:
+			if (s.depth == 0) {
+				goto unbalanced;
+			}
+
+			psca_pop(pool);
+			s.depth--;
+			s.live -= s.used[s.depth];
+			break;
+
+		case PSCA_TRACE_MERGE:
+			if (s.depth < 2) {
+				goto unbalanced;
+			}
+
+			psca_merge(pool);
+			s.depth--;
+			s.used[s.depth - 1] += s.used[s.depth];
+			break;
+
+		case PSCA_TRACE_MALLOC:
+		case PSCA_TRACE_COMMIT:
+			if (r_read_num(f, &a) != 0) {
+				goto truncated;
+			}
+
+			if (s.depth == 0) {
+				goto unbalanced;
+			}
+
+			if (c == PSCA_TRACE_MALLOC) {
+				psca_malloc(pool, a);
+			} else if (psca_begin_write(pool, a) != NULL) {
+				/* the room was reserved by the event before */
+				psca_commit(pool, a);
+			}
+
+			r_account(&s, a);
+			break;
+
+		case PSCA_TRACE_MALLOC_IN:
+			if ((r_read_num(f, &a) != 0) || (r_read_num(f, &b) != 0)) {
+				goto truncated;
+			}
+
+			if (a >= s.depth) {
+				goto unbalanced;
+			}
+
+			psca_malloc_in(pool, s.frames[s.depth - 1 - a], b);
+
+			s.used[s.depth - 1 - a] += b;
+			s.live += b;
+
+			if (s.live > s.peak_live) {
+				s.peak_live = s.live;
+			}
+			break;
+
+		case PSCA_TRACE_RESERVE:
+			if (r_read_num(f, &a) != 0) {
+				goto truncated;
+			}
+
+			if (s.depth == 0) {
+				goto unbalanced;
+			}
+
+			psca_reserve(pool, a);
+			break;
+
+		case PSCA_TRACE_BLOCK_ACQUIRE:
+		case PSCA_TRACE_BLOCK_RELEASE:
+			/* what the traced pool did is not what this one does */
+			if (r_read_num(f, &a) != 0) {
+				goto truncated;
+			}
+
+			ops--;
+			break;
+
+		default:
+			fprintf(stderr, "unknown operation %d after %zu operations\n",
+			        c, ops);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	while (s.depth > 0) {
+		psca_pop(pool);
+		s.depth--;
+	}
+
+	psca_destroy(pool);
+
+	if (mmap_prov != NULL) {
+		psca_mmap_destroy(mmap_prov);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	fprintf(stdout, "operations:      %zu\n", ops);
+	fprintf(stdout, "time:            %.3f ms\n",
+	        (end.tv_sec - start.tv_sec) * 1e3 +
+	        (end.tv_nsec - start.tv_nsec) / 1e6);
+	fprintf(stdout, "peak rss:        %ld KiB\n", ru.ru_maxrss);
+	fprintf(stdout, "peak requested:  %zu bytes\n", s.peak_live);
+	fprintf(stdout, "peak provided:   %zu bytes\n", g_prov.peak_bytes);
+	fprintf(stdout, "peak waste:      %zu bytes\n",
+	        (g_prov.peak_bytes > s.peak_live) ? g_prov.peak_bytes - s.peak_live : 0);
+	fprintf(stdout, "provider allocs: %zu\n", g_prov.allocs);
+	fprintf(stdout, "provider frees:  %zu (in %zu batches)\n", g_prov.frees,
+	        g_prov.batches);
+
+	free(s.frames);
+	free(s.used);
+	fclose(f);
+
+	return 0;
+
+truncated:
+	fprintf(stderr, "trace truncated after %zu operations\n", ops);
+	return 1;
+
+unbalanced:
+	fprintf(stderr, "unbalanced trace after %zu operations\n", ops);
+	return 1;
+
+nomem:
+	fprintf(stderr, "out of memory\n");
+	return 1;
+}
@@ -0,0 +1,165 @@
+/*
+ * Pool Stack C Allocator
+ *
+ * Copyright (C) Scott Kroll 2013
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shows the counters of every pool published with psca_set_export(), by
+ * any process on the machine, refreshed periodically.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <psca.h>
+
+/* where POSIX shared-memory objects show up on Linux */
+#define SHM_DIR "/dev/shm"
+
+static void
+print_size(size_t bytes)
+{
+	const char *units = "BKMGT";
+
+	while ((bytes >= 10 * 1024) && (units[1] != '\0')) {
+		bytes /= 1024;
+		units++;
+	}
+
+	fprintf(stdout, " %7zu%c", bytes, *units);
+}
+
+static int
+show(long pid)
+{
+	DIR *dir = opendir(SHM_DIR);
+	struct dirent *ent;
+	int shown = 0;
+
+	if (dir == NULL) {
+		perror(SHM_DIR);
+		return -1;
+	}
+
+	fprintf(stdout, "%7s %-24s %5s %6s %8s %8s %9s %9s %13s\n",
+	        "PID", "POOL", "DEPTH", "BLOCKS", "HELD", "PEAK",
+	        "ACQUIRED", "RELEASED", "PREFAULT HIT");
+
+	while ((ent = readdir(dir)) != NULL) {
+		psca_export_t info;
+		char path[sizeof(ent->d_name) + 1];
+
+		if (strncmp(ent->d_name, "psca.", 5) != 0) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/%s", ent->d_name);
+
+		if (psca_read_export(path, &info) != 0) {
+			continue;
+		}
+
+		if ((pid != 0) && (info.pid != pid)) {
+			continue;
+		}
+
+		/* pages of processes that died without cleaning up */
+		if ((kill((pid_t)info.pid, 0) == -1) && (errno == ESRCH)) {
+			continue;
+		}
+
+		fprintf(stdout, "%7ld %-24.24s %5u %6zu", info.pid, info.name,
+		        info.depth, info.stats.block_allocs - info.stats.block_frees);
+		print_size(info.stats.block_bytes);
+		print_size(info.peak_bytes);
+		fprintf(stdout, " %9zu %9zu %6zu/%-6zu\n", info.stats.block_allocs,
+		        info.stats.block_frees, info.stats.prefault_hits,
+		        info.stats.prefault_hits + info.stats.prefault_misses);
+
+		shown++;
+	}
+
+	closedir(dir);
+
+	return shown;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "usage: %s [options]\n"
+	    "\n"
+	    "  -d secs    delay between refreshes (default 1)\n"
+	    "  -n count   refresh count times and exit (default forever)\n"
+	    "  -p pid     only show the pools of a process\n", prog);
+}
+
+int
+main(int    argc,
+     char **argv)
+{
+	unsigned delay = 1;
+	long count = 0;
+	long pid = 0;
+	long i;
+	int tty = isatty(STDOUT_FILENO);
+	int c;
+
+	while ((c = getopt(argc, argv, "d:n:p:")) != -1) {
+		switch (c) {
+		case 'd':
+			delay = (unsigned)atoi(optarg);
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'p':
+			pid = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	for (i = 0; (count == 0) || (i < count); i++) {
+		if (i != 0) {
+			sleep(delay);
+		}
+
+		/* redraw in place on a terminal, append otherwise */
+		if (tty) {
+			fputs("\033[H\033[J", stdout);
+		} else if (i != 0) {
+			fputc('\n', stdout);
+		}
+
+		if (show(pid) < 0) {
+			return 1;
+		}
+
+		fflush(stdout);
+	}
+
+	return 0;
+}